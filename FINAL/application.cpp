@@ -4,6 +4,7 @@
 #include "utils.h"
 #include "entity.h"
 #include "camera.h"
+#include <map>
 
 Application::Application(const char* caption, int width, int height)
 {
@@ -18,7 +19,10 @@ Application::Application(const char* caption, int width, int height)
     this->window_height = h;
     this->keystate = SDL_GetKeyboardState(nullptr);
 
-    this->framebuffer.Resize(w, h);
+    this->renderTarget.Resize(w, h);
+
+    // 32 bit pixels: fills and the rasterizers store whole words, 'o' switches back to 24 bit
+    this->renderTarget.SetColorFormat(Image::FORMAT_RGBA);
 }
 
 Application::~Application()
@@ -355,7 +359,8 @@ void Application::Init(void)
 
     // Load textures
     texture_color_specular = new Image();
-    if (!texture_color_specular->LoadTGA("textures/lee_color_specular.tga", true)) {
+    texture_specular = new Image();
+    if (!texture_color_specular->LoadTGA("textures/lee_color_specular.tga", true, texture_specular)) {
         std::cerr << "[ERROR] Failed to load lee_color_specular.tga!\n";
         return;
     }
@@ -374,6 +379,7 @@ void Application::Init(void)
         entity->mesh = lee;
         entity->texture = texture_color_specular;
         entity->normalMap = texture_normal;
+        entity->specularMap = texture_specular;
         entity->id = i + 1;
 
         if (i == 0) entity->model.Translate(-1.5f, 0.0f, 0.0f);
@@ -384,6 +390,44 @@ void Application::Init(void)
         std::cout << "[INFO] Created Entity " << entity->id << " with Mesh and Textures.\n";
     }
 
+    // A scanned point set behind the heads, drawn as points. The scan is optional
+    Mesh* scan = new Mesh();
+    if (scan->LoadPoints("meshes/scan.ply")) {
+        Entity* entity = new Entity(scan);
+        entity->texture = nullptr;
+        entity->normalMap = nullptr;
+        entity->mode = eRenderMode::POINTCLOUD;
+        entity->is_moving = false;
+        entity->id = (int)entities.size() + 1;
+        entity->model.Translate(0.0f, 0.0f, -2.0f);
+        entities.push_back(entity);
+        std::cout << "[INFO] Created Entity " << entity->id << " with the point set of scan.ply.\n";
+    }
+    else {
+        delete scan;
+        std::cout << "[INFO] No meshes/scan.ply, the scene has no point set.\n";
+    }
+
+    // Lights for the deferred path: a warm key light, a cool fill light and a back light
+    sLight key, fill, back;
+    key.position = Vector3(2.0f, 2.0f, 3.0f);
+    key.color = Vector3(1.0f, 0.9f, 0.8f);
+    fill.position = Vector3(-3.0f, 0.5f, 2.0f);
+    fill.color = Vector3(0.3f, 0.4f, 0.6f);
+    back.position = Vector3(0.0f, 1.5f, -3.0f);
+    back.color = Vector3(0.6f, 0.6f, 0.6f);
+    lights.push_back(key);
+    lights.push_back(fill);
+    lights.push_back(back);
+
+    // And a sun from above, the only one casting shadows
+    sLight sun;
+    sun.type = sLight::DIRECTIONAL;
+    sun.direction = Vector3(-0.3f, -1.0f, -0.4f);
+    sun.color = Vector3(0.5f, 0.5f, 0.45f);
+    sun.castShadows = true;
+    lights.push_back(sun);
+
     std::cout << "Lee model and textures loaded successfully!\n";
 }
 
@@ -391,14 +435,73 @@ void Application::Render(void)
 {
     std::cout << "Rendering frame..." << std::endl; // Debug message
 
-    framebuffer.Fill(Color(0, 0, 0));  // Clear the framebuffer
+    std::vector<Entity*> sceneEntities;
+    if (current_scene == 1 && entities.size() > 2)
+        sceneEntities.push_back(entities[2]);
+    else if (current_scene == 2)
+        sceneEntities = entities;
+
+    // Moving entities change the shadows of everything else
+    if (useShadows) {
+        for (Entity* entity : sceneEntities)
+            if (entity && entity->is_moving)
+                frameCache.Invalidate();
+    }
 
-    // Initialize Z-buffer (if not done already)
-    FloatImage zBuffer(framebuffer.width, framebuffer.height);
-    for (int y = 0; y < framebuffer.height; ++y) {
-        for (int x = 0; x < framebuffer.width; ++x) {
-            zBuffer.SetPixel(x, y, 1.0f); // Initialize Z-buffer to the farthest distance (1.0)
-        }
+    // Lab 3 forward frames where only some entities changed keep the previous frame and redraw the
+    // tiles under those entities, with the entities that overlap them
+    std::vector<Entity*> redraw;
+    bool cached = useFrameCache && isLab3 && !useDeferred && !UsesMSAA() && !sceneEntities.empty() &&
+                  frameCache.Update(renderTarget, camera, sceneEntities, redraw);
+    if (!cached) {
+        // Clear color and Z-buffer (1.0 means farthest). The clear is lazy: only the tiles
+        // touched below and the ones drawn in the previous frame are written
+        renderTarget.Clear(Color(0, 0, 0), 1.0f);
+    }
+    else if (redraw.empty()) {
+        // Nothing changed: the last frame is still valid
+        framebuffer.Render();
+        return;
+    }
+
+    // Lights of this frame in the layout of the shading kernel
+    if (useShadows) {
+        if (current_scene == 1 && entities.size() > 2)
+            UpdateShadowMaps(std::vector<Entity*>(1, entities[2]));
+        else
+            UpdateShadowMaps(entities);
+    }
+    lighting.SetLights(lights, useShadows ? &shadowMaps : nullptr);
+    lighting.eye = camera->eye;
+    const sLighting* forwardLighting = useLighting ? &lighting : nullptr;
+
+    // Deferred shading: the geometry of every entity first, then a single lighting pass per pixel
+    if (isLab3 && useDeferred)
+    {
+        // The lighting pass writes every pixel
+        renderTarget.TouchAll();
+        if (current_scene == 1 && entities.size() > 2)
+            RenderDeferred(std::vector<Entity*>(1, entities[2]));
+        else if (current_scene == 2)
+            RenderDeferred(entities);
+
+        renderTarget.Resolve();
+        framebuffer.Render();
+        return;
+    }
+
+    // Clear the tiles the entities of the scene may draw on. The cache already cleared the ones to redraw
+    const std::vector<Entity*>& drawList = cached ? redraw : sceneEntities;
+    if (!cached)
+        TouchEntities(drawList);
+
+    // Depth prepass: the z-buffer ends up with the nearest depth, so the passes below shade each pixel once.
+    // Not with MSAA: its samples are tested on their own depth, seeded from the z-buffer
+    framebuffer.depthFunc = Image::DEPTH_LESS;
+    if (isLab3 && useDepthPrepass && !UsesMSAA())
+    {
+        RenderDepthPrepass(drawList, &zBuffer);
+        framebuffer.depthFunc = Image::DEPTH_EQUAL;
     }
 
     // Check which scene to render: Single entity (scene 1) or multiple entities (scene 2)
@@ -420,7 +523,7 @@ void Application::Render(void)
             // Call the Render function to draw the entity
             // Use RenderLab3 with Z-buffer if necessary
             if (isLab3) {
-                entity->RenderLab3(&framebuffer, camera, &zBuffer);
+                entity->RenderLab3(&framebuffer, camera, &zBuffer, forwardLighting);
             } else {
                 entity->RenderLab2(&framebuffer, camera, entityColor);
             }
@@ -429,9 +532,13 @@ void Application::Render(void)
                       << entityColor.r << ", " << entityColor.g << ", " << entityColor.b << ")" << std::endl;
         }
     }
+    else if (current_scene == 2 && isLab3 && useInstancing) // Render multiple entities grouped by mesh
+    {
+        RenderInstanced(drawList, &zBuffer, forwardLighting);
+    }
     else if (current_scene == 2) // Render multiple animated entities
     {
-        for (Entity* entity : entities) {
+        for (Entity* entity : drawList) {
             if (entity) {
                 Color entityColor = Color(255, 255, 255);  // Default color
 
@@ -445,7 +552,7 @@ void Application::Render(void)
 
                 // Use the same logic to handle Z-buffer for multiple entities
                 if (isLab3) {
-                    entity->RenderLab3(&framebuffer, camera, &zBuffer);
+                    entity->RenderLab3(&framebuffer, camera, &zBuffer, forwardLighting);
                 } else {
                     entity->RenderLab2(&framebuffer, camera, entityColor);
                 }
@@ -456,10 +563,180 @@ void Application::Render(void)
         }
     }
 
+    framebuffer.depthFunc = Image::DEPTH_LESS;
+
     // Render the final image
+    renderTarget.Resolve();
     framebuffer.Render();
 }
 
+// Clears now the tiles under the screen bounds of the entities, the rest of the target is left untouched
+void Application::TouchEntities(const std::vector<Entity*>& list)
+{
+    int x0, y0, x1, y1;
+    for (Entity* entity : list) {
+        if (entity && entity->GetScreenBounds(camera, framebuffer.width, framebuffer.height, x0, y0, x1, y1))
+            renderTarget.Touch(x0, y0, x1, y1);
+    }
+}
+
+// Groups the entities by mesh so each mesh is streamed once for all its instances
+void Application::RenderInstanced(const std::vector<Entity*>& list, DepthBuffer* zBuffer, const sLighting* lighting)
+{
+    std::map<Mesh*, std::vector<Entity*>> groups;
+    for (Entity* entity : list) {
+        if (entity && entity->mesh)
+            groups[entity->mesh].push_back(entity);
+    }
+
+    std::vector<std::vector<Vector3>> screenVertices;
+    for (auto& group : groups) {
+        std::vector<Entity*>& instances = group.second;
+
+        // A point set has no triangles to project, each instance splats its points
+        if (group.first->IsPointSet()) {
+            for (Entity* entity : instances)
+                entity->RenderPoints(&framebuffer, camera, zBuffer, Color(255, 255, 255));
+            continue;
+        }
+
+        Entity::ProjectInstances(instances, camera, framebuffer.width, framebuffer.height, screenVertices);
+
+        for (size_t k = 0; k < instances.size(); ++k) {
+            if (useRenderQueue && instances[k]->mode == eRenderMode::TRIANGLES_INTERPOLATED)
+                instances[k]->QueueProjected(&renderQueue, screenVertices[k], camera->eye, lighting);
+            else
+                instances[k]->RenderProjected(&framebuffer, screenVertices[k], zBuffer, lighting);
+        }
+    }
+
+    // Interpolated triangles of all the groups, in the order that keeps textures hot and rejects hidden fragments early
+    if (!UsesMSAA()) {
+        renderQueue.Flush(&framebuffer, zBuffer, lighting);
+        return;
+    }
+
+    // Multi-sampled: the queue has its own depth samples, starting from the z-buffer so what is already
+    // drawn hides the samples behind it, and is resolved over the framebuffer
+    msaa.Resize(framebuffer.width, framebuffer.height, msaaSamples);
+    msaa.Clear(zBuffer);
+    renderQueue.Flush(&msaa, lighting);
+    msaa.Resolve(&framebuffer);
+}
+
+// MSAA samples only the render queue: the Lab 3 forward path of scene 2, instanced and queued
+bool Application::UsesMSAA() const
+{
+    return msaaSamples != 0 && isLab3 && !useDeferred && current_scene == 2 && useInstancing && useRenderQueue;
+}
+
+// Writes the depth of the entities that will be shaded with the z-buffer, with the depth-only rasterizer
+void Application::RenderDepthPrepass(const std::vector<Entity*>& list, DepthBuffer* zBuffer)
+{
+    for (Entity* entity : list) {
+        if (entity && entity->useZBuffer && entity->mode == eRenderMode::TRIANGLES_INTERPOLATED)
+            entity->RenderDepth(zBuffer, camera);
+    }
+}
+
+// Renders the depth of the given entities from each light that casts shadows. The maps are kept
+// while the lights are static and no entity moves
+void Application::UpdateShadowMaps(const std::vector<Entity*>& list)
+{
+    const int shadowMapSize = 1024;
+    shadowMaps.resize(lights.size());
+
+    bool sceneMoved = shadowScene != current_scene;
+    Vector3 center(0, 0, 0);
+    for (Entity* entity : list) {
+        if (entity && entity->is_moving)
+            sceneMoved = true;
+        if (entity)
+            center = center + Vector3(entity->model.m[12], entity->model.m[13], entity->model.m[14]);
+    }
+    if (!list.empty())
+        center = center / (float)list.size();
+    shadowScene = current_scene;
+
+    float radius = 1.5f;
+    for (Entity* entity : list) {
+        if (entity)
+            radius = std::max(radius, (Vector3(entity->model.m[12], entity->model.m[13], entity->model.m[14]) - center).Length() + 1.5f);
+    }
+
+    for (size_t i = 0; i < lights.size(); ++i) {
+        const sLight& light = lights[i];
+        sShadowMap& shadowMap = shadowMaps[i];
+        if (!light.castShadows || light.type == sLight::POINT) {
+            shadowMap.valid = false;
+            continue;
+        }
+        if (shadowMap.valid && light.isStatic && !sceneMoved)
+            continue;
+
+        Vector3 direction = light.direction;
+        direction.Normalize();
+        Vector3 up = fabsf(direction.y) > 0.99f ? Vector3(0, 0, 1) : Vector3(0, 1, 0);
+
+        Camera lightCamera;
+        if (light.type == sLight::DIRECTIONAL) {
+            lightCamera.LookAt(center - direction * (radius * 2.0f), center, up);
+            lightCamera.SetOrthographic(-radius, radius, radius, -radius, 0.1f, radius * 4.0f);
+        }
+        else {
+            lightCamera.LookAt(light.position, light.position + direction, up);
+            lightCamera.SetPerspective(light.spotAngle * 2.0f, 1.0f, 0.1f, light.radius);
+        }
+
+        if (shadowMap.depth.width != shadowMapSize || shadowMap.depth.height != shadowMapSize)
+            shadowMap.depth.Resize(shadowMapSize, shadowMapSize);
+        shadowMap.depth.Fill(1.0f);
+        shadowMap.viewprojection = lightCamera.viewprojection_matrix;
+
+        for (Entity* entity : list) {
+            if (entity)
+                entity->RenderDepth(&shadowMap.depth, &lightCamera);
+        }
+        shadowMap.valid = true;
+    }
+}
+
+// Fills the G-buffer with the given entities and shades it with the scene lights
+void Application::RenderDeferred(const std::vector<Entity*>& list)
+{
+    gbuffer.Resize(framebuffer.width, framebuffer.height);
+    gbuffer.Clear();
+
+    std::vector<Entity*> pointSets;
+    for (Entity* entity : list) {
+        if (entity && entity->mesh && entity->mesh->IsPointSet())
+            pointSets.push_back(entity);
+        else if (entity)
+            entity->RenderDeferred(&gbuffer, camera);
+    }
+
+    if (!useHDR) {
+        gbuffer.Resolve(&framebuffer, lighting, camera);
+    }
+    else {
+        // The lights add up in float and are tone mapped once into the framebuffer
+        hdrBuffer.Resize(framebuffer.width, framebuffer.height);
+        hdrBuffer.Fill(sColorHDR{ 0.0f, 0.0f, 0.0f, 1.0f });
+        gbuffer.Resolve(&hdrBuffer, lighting, camera);
+        // The albedo is not linearized, the lit pixels are already display-referred: no gamma
+        hdrBuffer.Resolve(&framebuffer, toneMap, exposure, 1.0f);
+    }
+    if (pointSets.empty())
+        return;
+
+    // Point sets have no surface to light, they are splatted over the result behind the depth of the rest
+    for (Entity* entity : list) {
+        if (entity && entity->mesh && !entity->mesh->IsPointSet())
+            entity->RenderDepth(&zBuffer, camera);
+    }
+    for (Entity* entity : pointSets)
+        entity->RenderPoints(&framebuffer, camera, &zBuffer, Color(255, 255, 255));
+}
 
 void Application::Update(float seconds_elapsed)
 {
@@ -472,6 +749,9 @@ void Application::OnKeyPressed(SDL_KeyboardEvent event)
 {
     bool updated = false;
 
+    // Any key may change a setting the cached frame was drawn with
+    frameCache.Invalidate();
+
     switch (event.keysym.sym) {
         case SDLK_ESCAPE:
             exit(0);
@@ -513,6 +793,83 @@ void Application::OnKeyPressed(SDL_KeyboardEvent event)
                 std::cout << "[INFO] Alternando entre entidades estáticas y animadas." << std::endl;
             break;
             
+        case SDLK_LEFTBRACKET:   // Smaller points in POINTCLOUD mode
+        case SDLK_RIGHTBRACKET:  // Bigger points in POINTCLOUD mode
+            for (auto& entity : entities) {
+                int delta = event.keysym.sym == SDLK_RIGHTBRACKET ? 1 : -1;
+                entity->pointSize = std::max(1, std::min(entity->pointSize + delta, 16));
+            }
+            if (!entities.empty())
+                std::cout << "[INFO] Point size: " << entities[0]->pointSize << std::endl;
+            break;
+
+        case SDLK_i:  // Toggle instanced rendering of the entities that share a mesh
+            useInstancing = !useInstancing;
+            std::cout << "[INFO] Instancing " << (useInstancing ? "enabled" : "disabled") << std::endl;
+            break;
+
+        case SDLK_q:  // Toggle the sorted render queue
+            useRenderQueue = !useRenderQueue;
+            std::cout << "[INFO] Render queue " << (useRenderQueue ? "enabled" : "disabled") << std::endl;
+            break;
+
+        case SDLK_p:  // Toggle per pixel lighting of the interpolated triangles
+            useLighting = !useLighting;
+            std::cout << "[INFO] Lighting " << (useLighting ? "enabled" : "disabled") << std::endl;
+            break;
+
+        case SDLK_m:  // Toggle shadow maps
+            useShadows = !useShadows;
+            std::cout << "[INFO] Shadows " << (useShadows ? "enabled" : "disabled") << std::endl;
+            break;
+
+        case SDLK_x:  // Toggle the depth prepass
+            useDepthPrepass = !useDepthPrepass;
+            std::cout << "[INFO] Depth prepass " << (useDepthPrepass ? "enabled" : "disabled") << std::endl;
+            break;
+
+        case SDLK_b:  // Cycle the depth buffer format: 16-bit, 24-bit, 32-bit float
+            renderTarget.SetDepthFormat((zBuffer.format + 1) % 3);
+            std::cout << "[INFO] Depth buffer: " << zBuffer.GetFormatName() << std::endl;
+            break;
+
+        case SDLK_o:  // Toggle the pixel format of the framebuffer: 24 bit RGB or 32 bit RGBA
+            renderTarget.SetColorFormat(framebuffer.format == Image::FORMAT_RGBA ? Image::FORMAT_RGB : Image::FORMAT_RGBA);
+            std::cout << "[INFO] Framebuffer: " << (framebuffer.format == Image::FORMAT_RGBA ? "RGBA, 32 bit" : "RGB, 24 bit") << std::endl;
+            break;
+
+        case SDLK_g:  // Toggle deferred shading with the G-buffer
+            useDeferred = !useDeferred;
+            std::cout << "[INFO] Deferred shading " << (useDeferred ? "enabled" : "disabled") << std::endl;
+            break;
+
+        case SDLK_r:  // Toggle the reuse of the previous frame in the Lab 3 forward path
+            useFrameCache = !useFrameCache;
+            std::cout << "[INFO] Frame cache " << (useFrameCache ? "enabled" : "disabled") << std::endl;
+            break;
+
+        case SDLK_a:  // Cycle the anti-aliasing of the render queue: off, 2x, 4x, 8x MSAA
+            msaaSamples = msaaSamples == 0 ? 2 : (msaaSamples == 8 ? 0 : msaaSamples * 2);
+            if (msaaSamples != 0 && !UsesMSAA()) {
+                msaaSamples = 0;
+                std::cout << "[INFO] MSAA only applies to the render queue: Lab 3 forward, scene 2, instancing and queue on" << std::endl;
+            }
+            else if (msaaSamples == 0)
+                std::cout << "[INFO] MSAA disabled" << std::endl;
+            else
+                std::cout << "[INFO] MSAA " << msaaSamples << "x" << std::endl;
+            break;
+
+        case SDLK_h:  // Toggle the float lighting target of the deferred path
+            useHDR = !useHDR;
+            std::cout << "[INFO] HDR lighting " << (useHDR ? "enabled" : "disabled") << std::endl;
+            break;
+
+        case SDLK_j:  // Cycle the tone mapping of the HDR resolve
+            toneMap = (toneMap + 1) % HDRImage::TONEMAP_COUNT;
+            std::cout << "[INFO] Tone mapping: " << HDRImage::GetToneMapName(toneMap) << std::endl;
+            break;
+
         case SDLK_l:  // Toggle Lab 2 (Wireframe)
             isLab3 = false;
             std::cout << "Switched to Lab 2 (Wireframe mode)" << std::endl;
@@ -27,10 +27,32 @@ public:
     char property_mode; // 'N' = near, 'F' = far, 'V' = FOV
     Vector2 last_mouse_position;
     int current_scene;
-    FloatImage zBuffer;
+    RenderTarget renderTarget; // Framebuffer (RGBA by default, 'o' toggles RGB) and Z-buffer, cleared together
+    DepthBuffer& zBuffer = renderTarget.depth; // 16-bit by default, 'b' cycles the formats
     Image* texture_normal;
     Image* texture_color_specular;
     bool isLab3;
+    bool useInstancing = true; // Entities that share a mesh are projected together
+    bool useDeferred = false;  // Lab 3 shading through the G-buffer and the scene lights
+    Image* texture_specular;
+    GBuffer gbuffer;
+    HDRImage hdrBuffer;        // Deferred lighting in float, tone mapped into the framebuffer
+    bool useHDR = false;
+    int toneMap = HDRImage::TONEMAP_ACES;
+    float exposure = 1.0f;
+    std::vector<sLight> lights;
+    sLighting lighting;        // The lights of the current frame as the shading kernel reads them
+    bool useLighting = false;  // Per pixel Blinn-Phong in the Lab 3 forward path
+    bool useShadows = false;   // Shadow maps for the lights that cast shadows
+    bool useRenderQueue = true; // Lab 3 scene 2: interpolated triangles of all the entities sorted before drawing
+    RenderQueue renderQueue;
+    FrameCache frameCache;     // Lab 3 forward path: redraws only the tiles under the entities that changed
+    bool useFrameCache = true;
+    MSAABuffer msaa;           // Samples of the queued triangles when msaaSamples is not 0
+    int msaaSamples = 0;       // 0 (off), 2, 4 or 8, 'a' cycles them
+    bool useDepthPrepass = false; // Lab 3: depth of all the entities first, then shade only the visible fragments
+    std::vector<sShadowMap> shadowMaps; // One per light, kept while nothing moves
+    int shadowScene = -1;      // Scene the shadow maps were rendered for
     // Input
     const Uint8* keystate;
     int mouse_state; // Tells which buttons are pressed
@@ -45,7 +67,7 @@ public:
     void OnFileChanged(const char* filename);
 
     // CPU Global framebuffer
-    Image framebuffer;
+    Image& framebuffer = renderTarget.color;
 
     // Constructor and main methods
     Application(const char* caption, int width, int height);
@@ -54,13 +76,19 @@ public:
     void Init( void );
     void Render( void );
     void Update( float dt );
+    void RenderInstanced(const std::vector<Entity*>& list, DepthBuffer* zBuffer, const sLighting* lighting = nullptr);
+    void RenderDeferred(const std::vector<Entity*>& list);
+    void UpdateShadowMaps(const std::vector<Entity*>& list);
+    void RenderDepthPrepass(const std::vector<Entity*>& list, DepthBuffer* zBuffer);
+    bool UsesMSAA() const; // msaaSamples is set and the frame goes through the render queue
+    void TouchEntities(const std::vector<Entity*>& list);
 
     // Other methods to control the app
     void SetWindowSize(int width, int height) {
         glViewport( 0,0, width, height );
         this->window_width = width;
         this->window_height = height;
-        this->framebuffer.Resize(width, height);
+        this->renderTarget.Resize(width, height);
     }
 
     Vector2 GetWindowSize()
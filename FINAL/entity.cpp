@@ -2,6 +2,8 @@
 #include "camera.h"
 #include "utils.h"
 #include <cmath>
+#include <algorithm>
+#include <functional>
 #include "image.h"
 
 Entity::Entity() {
@@ -53,105 +55,631 @@ void Entity::ToggleMovement() {
 }
 
 void Entity::RenderLab2(Image* framebuffer, Camera* camera, const Color& c) {
+    if (!mesh || !mesh->IsPointSet()) {
+        RenderWireframe(framebuffer, camera, c);
+        return;
+    }
+
+    // A point set has no edges. Lab 2 has no z-buffer either, each point is a pixel
+    std::vector<Vector3> projected;
+    ProjectPoints(camera, framebuffer->width, framebuffer->height, projected);
+    for (const Vector3& p : projected) {
+        if (p.z >= -1 && p.z <= 1 && p.x >= 0 && p.y >= 0)
+            framebuffer->SetPixel((unsigned int)p.x, (unsigned int)p.y, c);
+    }
+}
+
+void Entity::RenderWireframe(Image* framebuffer, Camera* camera, const Color& c) {
     if (!mesh || !camera) return;
-    
+
+    // Project each unique position once instead of once per triangle corner
     const std::vector<Vector3>& vertices = mesh->GetVertices();
-    for (size_t i = 0; i < vertices.size(); i += 3) {
-        Vector3 worldVertices[3];
-        Vector3 projectedVertices[3];
-        bool validTriangle = true;
-        
-        for (int j = 0; j < 3; ++j) {
-            worldVertices[j] = model * vertices[i + j];
-            bool negZ = false;
-            projectedVertices[j] = camera->ProjectVector(worldVertices[j], negZ);
-            if (projectedVertices[j].x < -1 || projectedVertices[j].x > 1 ||
-                projectedVertices[j].y < -1 || projectedVertices[j].y > 1 ||
-                projectedVertices[j].z < -1 || projectedVertices[j].z > 1) {
-                validTriangle = false;
-            }
-        }
-        if (!validTriangle) continue;
-        
-        for (int j = 0; j < 3; ++j) {
-            projectedVertices[j].x = (projectedVertices[j].x + 1.0f) * 0.5f * framebuffer->width;
-            projectedVertices[j].y = (1.0f - projectedVertices[j].y) * 0.5f * framebuffer->height;
+    const std::vector<int>& wireVertices = mesh->GetWireVertices();
+    int numVertices = (int)wireVertices.size();
+
+    Matrix44 mvp = camera->viewprojection_matrix * model;
+    const float* m = mvp.m;
+    bool perspective = camera->type == Camera::PERSPECTIVE;
+    float halfWidth = 0.5f * framebuffer->width;
+    float halfHeight = 0.5f * framebuffer->height;
+
+    std::vector<Vector3> projected(numVertices);
+
+    #pragma omp parallel for
+    for (int v = 0; v < numVertices; ++v) {
+        const Vector3& p = vertices[wireVertices[v]];
+        float x = m[0] * p.x + m[4] * p.y + m[8] * p.z + m[12];
+        float y = m[1] * p.x + m[5] * p.y + m[9] * p.z + m[13];
+        float z = m[2] * p.x + m[6] * p.y + m[10] * p.z + m[14];
+
+        if (perspective) {
+            float invW = 1.0f / (m[3] * p.x + m[7] * p.y + m[11] * p.z + m[15]);
+            x *= invW;
+            y *= invW;
+            z *= invW;
         }
-        
-        framebuffer->DrawLineDDA(projectedVertices[0].x, projectedVertices[0].y, projectedVertices[2].x, projectedVertices[2].y, c);
-        framebuffer->DrawLineDDA(projectedVertices[2].x, projectedVertices[2].y, projectedVertices[1].x, projectedVertices[1].y, c);
-        framebuffer->DrawLineDDA(projectedVertices[1].x, projectedVertices[1].y, projectedVertices[0].x, projectedVertices[0].y, c);
-        
+
+        projected[v].x = (x + 1.0f) * halfWidth;
+        projected[v].y = (1.0f - y) * halfHeight;
+        projected[v].z = z;
+    }
+
+    DrawEdges(framebuffer, projected, c);
+}
+
+void Entity::DrawEdges(Image* framebuffer, const std::vector<Vector3>& projected, const Color& c) {
+    const std::vector<sEdge>& edges = mesh->GetEdges();
+    std::vector<sLineSegment> lines;
+    lines.reserve(edges.size());
+
+    for (const sEdge& edge : edges) {
+        const Vector3& a = projected[edge.a];
+        const Vector3& b = projected[edge.b];
+
+        // Edges with an end outside the depth range (e.g. behind the camera) are skipped,
+        // the rest are clipped to the framebuffer by the line rasterizer
+        if (a.z < -1 || a.z > 1 || b.z < -1 || b.z > 1) continue;
+        lines.push_back({ (int)a.x, (int)a.y, (int)b.x, (int)b.y });
+    }
+
+    framebuffer->DrawLines(lines, c);
+}
+
+void Entity::RenderLab3(Image* framebuffer, Camera* camera, DepthBuffer* zBuffer, const sLighting* lighting) {
+    if (!mesh || !camera || !zBuffer) return;
+
+    // A point set has nothing but points, whatever the mode
+    if (mode == eRenderMode::POINTCLOUD || mesh->IsPointSet()) {
+        RenderPoints(framebuffer, camera, zBuffer, Color(255, 255, 255));
+        return;
+    }
+    if (mode == eRenderMode::WIREFRAME) {
+        RenderWireframe(framebuffer, camera, Color(255, 255, 255));
+        return;
     }
+
+    // A single entity is just an instanced draw with one instance
+    std::vector<Entity*> instance(1, this);
+    std::vector<std::vector<Vector3>> screenVertices;
+    ProjectInstances(instance, camera, framebuffer->width, framebuffer->height, screenVertices);
+
+    RenderProjected(framebuffer, screenVertices[0], zBuffer, lighting);
 }
 
-void Entity::RenderLab3(Image* framebuffer, Camera* camera, FloatImage* zBuffer) {
+void Entity::RenderPoints(Image* framebuffer, Camera* camera, DepthBuffer* zBuffer, const Color& c) {
     if (!mesh || !camera || !zBuffer) return;
 
-    const std::vector<Vector3>& vertices = mesh->GetVertices();
+    std::vector<Vector3> projected;
+    ProjectPoints(camera, framebuffer->width, framebuffer->height, projected);
+    SplatPoints(framebuffer, projected, zBuffer, c);
+}
+
+// Screen position and NDC depth of every point of the mesh
+void Entity::ProjectPoints(Camera* camera, int width, int height, std::vector<Vector3>& projected) {
+    const std::vector<Vector3>& points = mesh->GetPoints();
+    int numPoints = (int)points.size();
+
+    Matrix44 mvp = camera->viewprojection_matrix * model;
+    const float* m = mvp.m;
+    bool perspective = camera->type == Camera::PERSPECTIVE;
+    float halfWidth = 0.5f * width;
+    float halfHeight = 0.5f * height;
+
+    projected.resize(numPoints);
+
+    // Project in chunks spread over the threads, each chunk a straight loop the compiler can vectorize
+    const int chunkSize = 4096;
+
+    #pragma omp parallel for
+    for (int start = 0; start < numPoints; start += chunkSize) {
+        int end = std::min(start + chunkSize, numPoints);
+        const Vector3* in = &points[0];
+        Vector3* out = &projected[0];
+
+        #pragma omp simd
+        for (int v = start; v < end; ++v) {
+            float px = in[v].x, py = in[v].y, pz = in[v].z;
+            float x = m[0] * px + m[4] * py + m[8] * pz + m[12];
+            float y = m[1] * px + m[5] * py + m[9] * pz + m[13];
+            float z = m[2] * px + m[6] * py + m[10] * pz + m[14];
+            float w = perspective ? m[3] * px + m[7] * py + m[11] * pz + m[15] : 1.0f;
+            float invW = 1.0f / w;
+
+            out[v].x = (x * invW + 1.0f) * halfWidth;
+            out[v].y = (1.0f - y * invW) * halfHeight;
+            out[v].z = z * invW;
+        }
+    }
+}
+
+// Draws the binned points band by band with the depth test in format F, into pixels of type P (the
+// format of the framebuffer). Each band writes only its own rows, so the depth test needs no locking
+template <typename F, typename P>
+static void SplatBands(P* pixels, int width, int height, typename F::Type* zBuffer, const std::vector<Vector3>& projected, const std::vector<int>& order,
+                       const std::vector<int>& bandStart, int bandHeight, int size, int half, const P& c)
+{
+    int numBands = (int)bandStart.size() - 1;
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int b = 0; b < numBands; ++b) {
+        int bandY0 = b * bandHeight;
+        int bandY1 = std::min(bandY0 + bandHeight, height);
+
+        for (int k = bandStart[std::max(b - 1, 0)]; k < bandStart[b + 1]; ++k) {
+            const Vector3& p = projected[order[k]];
+            typename F::Type z = F::Encode(p.z);
+            int x0 = (int)std::floor(p.x) - half;
+            int y0 = (int)std::floor(p.y) - half;
+            int xs = std::max(x0, 0), xe = std::min(x0 + size, width);
+            int ys = std::max(y0, bandY0), ye = std::min(y0 + size, bandY1);
+
+            for (int y = ys; y < ye; ++y) {
+                typename F::Type* depth = zBuffer + y * width;
+                P* pixel = pixels + y * width;
+                for (int x = xs; x < xe; ++x) {
+                    if (z < depth[x]) {
+                        depth[x] = z;
+                        pixel[x] = c;
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Picks the splat loop for the depth format of the z-buffer
+template <typename P>
+static void SplatFormat(P* pixels, int width, int height, DepthBuffer* zBuffer, const std::vector<Vector3>& projected, const std::vector<int>& order,
+                        const std::vector<int>& bandStart, int bandHeight, int size, int half, const P& c)
+{
+    switch (zBuffer->format) {
+        case DepthBuffer::DEPTH16:  SplatBands<sDepth16>(pixels, width, height, zBuffer->Data<sDepth16>(), projected, order, bandStart, bandHeight, size, half, c); break;
+        case DepthBuffer::DEPTH24:  SplatBands<sDepth24>(pixels, width, height, zBuffer->Data<sDepth24>(), projected, order, bandStart, bandHeight, size, half, c); break;
+        default:                    SplatBands<sDepth32F>(pixels, width, height, zBuffer->Data<sDepth32F>(), projected, order, bandStart, bandHeight, size, half, c); break;
+    }
+}
+
+void Entity::SplatPoints(Image* framebuffer, const std::vector<Vector3>& projected, DepthBuffer* zBuffer, const Color& c) {
+    int width = framebuffer->width;
+    int height = framebuffer->height;
+    if (width == 0 || height == 0 || zBuffer->width != (unsigned int)width || zBuffer->height != (unsigned int)height) return;
+
+    // A splat never spans more than two bands, so each band only looks at its own points and the band above
+    const int bandHeight = 32;
+    int size = std::max(1, std::min(pointSize, bandHeight / 2));
+    int half = (size - 1) / 2;
+    int numBands = (height + bandHeight - 1) / bandHeight;
+    int numPoints = (int)projected.size();
+
+    // Bin the visible points by the band of their top row (counting sort)
+    std::vector<int> top(numPoints, -1);
+    std::vector<int> bandStart(numBands + 1, 0);
+    for (int i = 0; i < numPoints; ++i) {
+        const Vector3& p = projected[i];
+        if (!(p.z >= -1.0f && p.z <= 1.0f)) continue;
+        if (!(p.x >= -size && p.x < width + size && p.y >= -size && p.y < height + size)) continue;
+
+        int y0 = (int)std::floor(p.y) - half;
+        if (y0 + size <= 0 || y0 >= height) continue;
+        top[i] = std::max(y0, 0);
+        bandStart[top[i] / bandHeight + 1]++;
+    }
+    for (int b = 0; b < numBands; ++b)
+        bandStart[b + 1] += bandStart[b];
+
+    std::vector<int> order(bandStart[numBands]);
+    std::vector<int> fill(bandStart.begin(), bandStart.end() - 1);
+    for (int i = 0; i < numPoints; ++i) {
+        if (top[i] >= 0)
+            order[fill[top[i] / bandHeight]++] = i;
+    }
+
+    if (framebuffer->format == Image::FORMAT_RGBA)
+        SplatFormat(framebuffer->pixelsRGBA, width, height, zBuffer, projected, order, bandStart, bandHeight, size, half, ColorRGBA(c));
+    else
+        SplatFormat(framebuffer->pixels, width, height, zBuffer, projected, order, bandStart, bandHeight, size, half, c);
+}
+
+void Entity::RenderDepth(DepthBuffer* depth, Camera* camera) {
+    if (!mesh || !camera || !depth) return;
+
+    std::vector<Entity*> instance(1, this);
+    std::vector<std::vector<Vector3>> screenVertices;
+    ProjectInstances(instance, camera, depth->width, depth->height, screenVertices);
+
+    depth->RasterizeDepth(screenVertices[0]);
+}
+
+void Entity::RenderDepth(FloatImage* depth, Camera* camera) {
+    if (!mesh || !camera || !depth) return;
+
+    std::vector<Entity*> instance(1, this);
+    std::vector<std::vector<Vector3>> screenVertices;
+    ProjectInstances(instance, camera, depth->width, depth->height, screenVertices);
+
+    depth->RasterizeDepth(screenVertices[0]);
+}
+
+void Entity::RenderDeferred(GBuffer* gbuffer, Camera* camera) {
+    if (!mesh || !camera || !gbuffer) return;
+
+    std::vector<Entity*> instance(1, this);
+    std::vector<std::vector<Vector3>> screenVertices;
+    ProjectInstances(instance, camera, gbuffer->width, gbuffer->height, screenVertices);
+
+    const std::vector<Vector3>& projected = screenVertices[0];
+    const std::vector<Vector3>& normals = mesh->GetNormals();
     const std::vector<Vector2>& uvs = mesh->GetUVs();
-    
-    for (size_t i = 0; i < vertices.size(); i += 3) {
+
+    sSurfaceInfo surface;
+    surface.texture = texture;
+    surface.specularMap = specularMap;
+    surface.normalMap = normalMap;
+    surface.model = model.m;
+
+    for (size_t i = 0; i + 2 < projected.size(); i += 3) {
+        const Vector3* p = &projected[i];
+
+        // Triangles crossing the near or far plane are skipped, they would be badly projected
+        if (p[0].z < -1 || p[0].z > 1 || p[1].z < -1 || p[1].z > 1 || p[2].z < -1 || p[2].z > 1) continue;
+
         sTriangleInfo triangle;
+        triangle.p0 = p[0];
+        triangle.p1 = p[1];
+        triangle.p2 = p[2];
+        if (i + 2 < uvs.size()) {
+            triangle.uv0 = uvs[i];
+            triangle.uv1 = uvs[i + 1];
+            triangle.uv2 = uvs[i + 2];
+        }
+        triangle.texture = texture;
 
-        // Transform vertices from model space to world space
-        Vector3 worldVertices[3];
-        for (int j = 0; j < 3; ++j) {
-            worldVertices[j] = model * vertices[i + j];
+        Vector3 worldNormals[3];
+        if (i + 2 < normals.size()) {
+            for (int j = 0; j < 3; ++j)
+                worldNormals[j] = model.RotateVector(normals[i + j]);
         }
 
-        // Project from world space to screen space
-        Vector3 screenVertices[3];
-        bool negZ;
-        for (int j = 0; j < 3; ++j) {
-            Vector3 projected = camera->ProjectVector(worldVertices[j], negZ);
-            screenVertices[j].x = (projected.x + 1.0f) * 0.5f * framebuffer->width;
-            screenVertices[j].y = (1.0f - projected.y) * 0.5f * framebuffer->height;
-            screenVertices[j].z = projected.z;
+        gbuffer->DrawTriangle(triangle, worldNormals, surface);
+    }
+}
+
+bool Entity::GetScreenBounds(Camera* camera, int width, int height, int& x0, int& y0, int& x1, int& y1) {
+    if (!mesh || !camera || width <= 0 || height <= 0) return false;
+
+    Vector3 bmin, bmax;
+    mesh->GetBounds(bmin, bmax);
+    Matrix44 mvp = camera->viewprojection_matrix * model;
+    const float* m = mvp.m;
+
+    // Corners in clip space: outside if all of them are beyond the same plane
+    int outside[6] = { 0, 0, 0, 0, 0, 0 };
+    float minX = 1e30f, minY = 1e30f, maxX = -1e30f, maxY = -1e30f;
+    bool crossesCamera = false;
+    for (int i = 0; i < 8; ++i) {
+        Vector3 p((i & 1) ? bmax.x : bmin.x, (i & 2) ? bmax.y : bmin.y, (i & 4) ? bmax.z : bmin.z);
+        float x = m[0] * p.x + m[4] * p.y + m[8] * p.z + m[12];
+        float y = m[1] * p.x + m[5] * p.y + m[9] * p.z + m[13];
+        float z = m[2] * p.x + m[6] * p.y + m[10] * p.z + m[14];
+        float w = m[3] * p.x + m[7] * p.y + m[11] * p.z + m[15];
+
+        outside[0] += x < -w; outside[1] += x > w;
+        outside[2] += y < -w; outside[3] += y > w;
+        outside[4] += z < -w; outside[5] += z > w;
+
+        if (w <= 1e-6f) {
+            crossesCamera = true;
+            continue;
         }
+        minX = std::min(minX, x / w); maxX = std::max(maxX, x / w);
+        minY = std::min(minY, y / w); maxY = std::max(maxY, y / w);
+    }
+    for (int plane = 0; plane < 6; ++plane) {
+        if (outside[plane] == 8) return false;
+    }
+
+    if (crossesCamera) {
+        x0 = 0; y0 = 0; x1 = width - 1; y1 = height - 1;
+        return true;
+    }
+
+    // Screen y goes down. Points are splatted around their position, so the box grows by the point size
+    int margin = pointSize + 1;
+    x0 = std::max((int)std::floor((minX + 1.0f) * 0.5f * width) - margin, 0);
+    x1 = std::min((int)std::ceil((maxX + 1.0f) * 0.5f * width) + margin, width - 1);
+    y0 = std::max((int)std::floor((1.0f - maxY) * 0.5f * height) - margin, 0);
+    y1 = std::min((int)std::ceil((1.0f - minY) * 0.5f * height) + margin, height - 1);
+    return x0 <= x1 && y0 <= y1;
+}
+
+void Entity::ProjectInstances(const std::vector<Entity*>& instances, Camera* camera, int width, int height, std::vector<std::vector<Vector3>>& screenVertices) {
+    screenVertices.resize(instances.size());
+    if (instances.empty() || !instances[0]->mesh || !camera) return;
+
+    const std::vector<Vector3>& vertices = instances[0]->mesh->GetVertices();
+    int numVertices = (int)vertices.size();
+    int numInstances = (int)instances.size();
 
-        // Handle different rendering modes
-        switch (mode) {
-            case eRenderMode::POINTCLOUD:
-                // Render only points (no edges or filled triangles)
-                for (int j = 0; j < 3; ++j) {
-                    framebuffer->SetPixel(screenVertices[j].x, screenVertices[j].y, Color(255, 255, 255));
+    // Model-view-projection per instance, so each vertex needs a single matrix product
+    std::vector<Matrix44> mvp(numInstances);
+    for (int k = 0; k < numInstances; ++k) {
+        mvp[k] = camera->viewprojection_matrix * instances[k]->model;
+        screenVertices[k].resize(numVertices);
+    }
+
+    bool perspective = camera->type == Camera::PERSPECTIVE;
+    float halfWidth = 0.5f * width;
+    float halfHeight = 0.5f * height;
+
+    // The mesh is read in small blocks that stay in cache while every instance matrix is applied to them
+    const int blockSize = 256;
+
+    #pragma omp parallel for
+    for (int start = 0; start < numVertices; start += blockSize) {
+        int end = std::min(start + blockSize, numVertices);
+
+        for (int k = 0; k < numInstances; ++k) {
+            const float* m = mvp[k].m;
+            Vector3* out = &screenVertices[k][0];
+
+            for (int v = start; v < end; ++v) {
+                const Vector3& p = vertices[v];
+                float x = m[0] * p.x + m[4] * p.y + m[8] * p.z + m[12];
+                float y = m[1] * p.x + m[5] * p.y + m[9] * p.z + m[13];
+                float z = m[2] * p.x + m[6] * p.y + m[10] * p.z + m[14];
+
+                if (perspective) {
+                    float invW = 1.0f / (m[3] * p.x + m[7] * p.y + m[11] * p.z + m[15]);
+                    x *= invW;
+                    y *= invW;
+                    z *= invW;
                 }
-                break;
-
-            case eRenderMode::WIREFRAME:
-                // Draw only the wireframe of the triangle
-                framebuffer->DrawLineDDA(screenVertices[0].x, screenVertices[0].y, screenVertices[1].x, screenVertices[1].y, Color(255, 255, 255));
-                framebuffer->DrawLineDDA(screenVertices[1].x, screenVertices[1].y, screenVertices[2].x, screenVertices[2].y, Color(255, 255, 255));
-                framebuffer->DrawLineDDA(screenVertices[2].x, screenVertices[2].y, screenVertices[0].x, screenVertices[0].y, Color(255, 255, 255));
-                break;
-
-            case eRenderMode::TRIANGLES:
-                // Render solid triangles using white color (no texture)
-                framebuffer->DrawTriangle(screenVertices[0].GetVector2(), screenVertices[1].GetVector2(), screenVertices[2].GetVector2(),
-                                          Color(255, 255, 255), true, Color(255, 255, 255));
-                break;
-
-            case eRenderMode::TRIANGLES_INTERPOLATED:
-                // Fill sTriangleInfo structure for interpolated rendering
-                triangle.p0 = screenVertices[0];
-                triangle.p1 = screenVertices[1];
-                triangle.p2 = screenVertices[2];
-
-                triangle.uv0 = uvs[i];
-                triangle.uv1 = uvs[i + 1];
-                triangle.uv2 = uvs[i + 2];
-
-                // Here you can choose whether to use vertex colors or texture
-                triangle.c0 = Color(255, 0, 0);  // Red
-                triangle.c1 = Color(0, 255, 0);  // Green
-                triangle.c2 = Color(0, 0, 255);  // Blue
-
-                triangle.texture = (texture != nullptr) ? texture : nullptr;  // If texture is disabled, use colors
-
-                // Call rasterization
-                framebuffer->DrawTriangleInterpolated(triangle, zBuffer, useZBuffer);
-                break;
+
+                // Clip space to screen space
+                out[v].x = (x + 1.0f) * halfWidth;
+                out[v].y = (1.0f - y) * halfHeight;
+                out[v].z = z;
+            }
+        }
+    }
+}
+
+void Entity::RenderProjected(Image* framebuffer, const std::vector<Vector3>& screenVertices, DepthBuffer* zBuffer, const sLighting* lighting) {
+    if (!mesh || !zBuffer) return;
+
+    // Draw each edge or point of the mesh once, picking them from the already projected vertices
+    if (mode == eRenderMode::WIREFRAME || mode == eRenderMode::POINTCLOUD) {
+        const std::vector<int>& wireVertices = mesh->GetWireVertices();
+        std::vector<Vector3> projected(wireVertices.size());
+        for (size_t v = 0; v < wireVertices.size(); ++v)
+            projected[v] = screenVertices[wireVertices[v]];
+
+        if (mode == eRenderMode::WIREFRAME)
+            DrawEdges(framebuffer, projected, Color(255, 255, 255));
+        else
+            SplatPoints(framebuffer, projected, zBuffer, Color(255, 255, 255));
+        return;
+    }
+
+    if (mode == eRenderMode::TRIANGLES) {
+        // Render solid triangles using white color (no texture)
+        for (size_t i = 0; i + 2 < screenVertices.size(); i += 3) {
+            const Vector3* screenVertices3 = &screenVertices[i];
+            framebuffer->DrawTriangle(Vector2(screenVertices3[0].x, screenVertices3[0].y), Vector2(screenVertices3[1].x, screenVertices3[1].y), Vector2(screenVertices3[2].x, screenVertices3[2].y),
+                                      Color(255, 255, 255), true, Color(255, 255, 255));
+        }
+        return;
+    }
+
+    // Submit all the triangles of the entity to the rasterizer at once
+    std::vector<sTriangleInfo> triangles;
+    BuildTriangles(screenVertices, lighting != nullptr, triangles);
+    if (!triangles.empty())
+        framebuffer->DrawTrianglesInterpolated(triangles, zBuffer, useZBuffer, lighting);
+}
+
+void Entity::QueueProjected(RenderQueue* queue, const std::vector<Vector3>& screenVertices, const Vector3& eye, const sLighting* lighting) {
+    if (!mesh || !queue) return;
+
+    sRenderBatch& batch = queue->Add(this, eye);
+    BuildTriangles(screenVertices, lighting != nullptr, batch.triangles);
+}
+
+void Entity::BuildTriangles(const std::vector<Vector3>& screenVertices, bool lit, std::vector<sTriangleInfo>& triangles) {
+    const std::vector<Vector2>& uvs = mesh->GetUVs();
+    const std::vector<Vector3>& vertices = mesh->GetVertices();
+    const std::vector<Vector3>& normals = mesh->GetNormals();
+
+    triangles.clear();
+    triangles.reserve(screenVertices.size() / 3);
+
+    for (size_t i = 0; i + 2 < screenVertices.size(); i += 3) {
+        const Vector3* screenVertices3 = &screenVertices[i];
+
+        // Fill sTriangleInfo structure for interpolated rendering
+        sTriangleInfo triangle;
+        triangle.p0 = screenVertices3[0];
+        triangle.p1 = screenVertices3[1];
+        triangle.p2 = screenVertices3[2];
+
+        triangle.uv0 = uvs[i];
+        triangle.uv1 = uvs[i + 1];
+        triangle.uv2 = uvs[i + 2];
+
+        // Here you can choose whether to use vertex colors or texture
+        triangle.c0 = Color(255, 0, 0);  // Red
+        triangle.c1 = Color(0, 255, 0);  // Green
+        triangle.c2 = Color(0, 0, 255);  // Blue
+
+        triangle.texture = (texture != nullptr) ? texture : nullptr;  // If texture is disabled, use colors
+
+        // World space attributes for the lighting kernel
+        if (lit) {
+            triangle.world0 = model * vertices[i];
+            triangle.world1 = model * vertices[i + 1];
+            triangle.world2 = model * vertices[i + 2];
+            if (i + 2 < normals.size()) {
+                triangle.n0 = model.RotateVector(normals[i]);
+                triangle.n1 = model.RotateVector(normals[i + 1]);
+                triangle.n2 = model.RotateVector(normals[i + 2]);
+            }
+            triangle.normalMap = normalMap;
+            triangle.specularMap = specularMap;
+            triangle.model = model.m;
         }
+
+        triangles.push_back(triangle);
+    }
+}
+
+void RenderQueue::Clear() {
+    count = 0;
+}
+
+sRenderBatch& RenderQueue::Add(Entity* entity, const Vector3& eye) {
+    if (count == batches.size())
+        batches.emplace_back();
+
+    sRenderBatch& batch = batches[count++];
+    Vector3 origin(entity->model.m[12], entity->model.m[13], entity->model.m[14]);
+    Vector3 toEntity = origin - eye;
+    batch.entity = entity;
+    batch.texture = entity->texture;
+    batch.depth = toEntity.Dot(toEntity);
+    batch.useZBuffer = entity->useZBuffer;
+    batch.triangles.clear();
+    return batch;
+}
+
+void RenderQueue::Sort() {
+    // Sort indices, the batches own their triangle arrays and stay in place
+    order.resize(count);
+    for (size_t i = 0; i < count; ++i)
+        order[i] = (int)i;
+
+    const std::vector<sRenderBatch>& b = batches;
+    std::sort(order.begin(), order.end(), [&b](int i, int j) {
+        if (b[i].useZBuffer != b[j].useZBuffer)
+            return b[i].useZBuffer;
+        if (!b[i].useZBuffer)
+            return b[i].depth > b[j].depth;
+        if (b[i].texture != b[j].texture)
+            return std::less<Image*>()(b[i].texture, b[j].texture);
+        return b[i].depth < b[j].depth;
+    });
+}
+
+void RenderQueue::Flush(Image* framebuffer, DepthBuffer* zBuffer, const sLighting* lighting) {
+    Sort();
+
+    for (int i : order) {
+        const sRenderBatch& batch = batches[i];
+        if (!batch.triangles.empty())
+            framebuffer->DrawTrianglesInterpolated(batch.triangles, zBuffer, batch.useZBuffer, lighting);
+    }
+    Clear();
+}
+
+void RenderQueue::Flush(MSAABuffer* framebuffer, const sLighting* lighting) {
+    Sort();
+
+    for (int i : order) {
+        const sRenderBatch& batch = batches[i];
+        if (!batch.triangles.empty())
+            framebuffer->DrawTrianglesInterpolated(batch.triangles, batch.useZBuffer, lighting);
+    }
+    Clear();
+}
+
+bool FrameCache::Update(RenderTarget& target, Camera* camera, const std::vector<Entity*>& list, std::vector<Entity*>& redraw) {
+    redraw.clear();
+    unsigned int w = target.color.width;
+    unsigned int h = target.color.height;
+
+    // State of the entities in this frame
+    bool cacheable = camera != nullptr;
+    std::vector<sEntityState> current(list.size());
+    for (size_t i = 0; i < list.size() && cacheable; ++i) {
+        Entity* entity = list[i];
+        // Interpolated triangles and point splats are depth tested, redrawing them over a cleared tile gives the same pixels
+        bool depthTested = entity && entity->mesh && entity->useZBuffer &&
+                           (entity->mode == eRenderMode::TRIANGLES_INTERPOLATED || entity->mesh->IsPointSet());
+        if (!depthTested) {
+            cacheable = false;
+            break;
+        }
+        sEntityState& state = current[i];
+        state.entity = entity;
+        state.mesh = entity->mesh;
+        state.model = entity->model;
+        state.mode = entity->mode;
+        state.useZBuffer = entity->useZBuffer;
+        state.texture = entity->texture;
+        state.normalMap = entity->normalMap;
+        state.specularMap = entity->specularMap;
+        state.visible = entity->GetScreenBounds(camera, w, h, state.x0, state.y0, state.x1, state.y1);
+    }
+
+    bool reuse = valid && cacheable && w == width && h == height && states.size() == current.size() &&
+                 memcmp(viewprojection.m, camera->viewprojection_matrix.m, sizeof(viewprojection.m)) == 0;
+
+    valid = cacheable;
+    if (!cacheable) {
+        states.clear();
+        return false;
+    }
+
+    // Tiles under the previous and the current bounds of every entity that changed
+    int tilesX = target.GetTilesX();
+    int tilesY = target.GetTilesY();
+    dirty.assign(tilesX * tilesY, 0);
+
+    // Calls f(tile) for the tiles under the bounds of a visible entity
+    auto forEachTile = [&](const sEntityState& state, auto f) {
+        if (!state.visible) return;
+        int tx0 = std::max(state.x0, 0) / RenderTarget::TILE_SIZE, tx1 = std::min(state.x1 / RenderTarget::TILE_SIZE, tilesX - 1);
+        int ty0 = std::max(state.y0, 0) / RenderTarget::TILE_SIZE, ty1 = std::min(state.y1 / RenderTarget::TILE_SIZE, tilesY - 1);
+        for (int ty = ty0; ty <= ty1; ++ty)
+            for (int tx = tx0; tx <= tx1; ++tx)
+                f(ty * tilesX + tx);
+    };
+    auto markTiles = [&](const sEntityState& state) { forEachTile(state, [&](int tile) { dirty[tile] = 1; }); };
+
+    bool anyDirty = false;
+    for (size_t i = 0; i < current.size() && reuse; ++i) {
+        const sEntityState& before = states[i];
+        const sEntityState& now = current[i];
+        if (before.entity != now.entity) {
+            reuse = false;
+            break;
+        }
+
+        bool changed = now.entity->is_moving || before.mesh != now.mesh || before.mode != now.mode || before.useZBuffer != now.useZBuffer ||
+                       before.texture != now.texture || before.normalMap != now.normalMap || before.specularMap != now.specularMap ||
+                       memcmp(before.model.m, now.model.m, sizeof(now.model.m)) != 0;
+        if (changed) {
+            markTiles(before);
+            markTiles(now);
+            anyDirty = true;
+        }
+    }
+
+    states.swap(current);
+    viewprojection = camera->viewprojection_matrix;
+    width = w;
+    height = h;
+    if (!reuse)
+        return false;
+    if (!anyDirty)
+        return true;
+
+    // The cleared tiles get everything that overlaps them drawn again
+    target.Invalidate(dirty);
+    for (const sEntityState& state : states) {
+        bool overlaps = false;
+        forEachTile(state, [&](int tile) { overlaps = overlaps || dirty[tile]; });
+        if (overlaps)
+            redraw.push_back(state.entity);
     }
+    return true;
 }
@@ -11,6 +11,8 @@ enum class eRenderMode {
     TRIANGLES_INTERPOLATED
 };
 
+class RenderQueue;
+
 class Entity {
 public:
     Mesh* mesh;
@@ -22,9 +24,11 @@ public:
     void ToggleMovement();
     Image* texture;
     Image* normalMap;
+    Image* specularMap = nullptr; // Alpha channel of the color texture
 
 
     eRenderMode mode;
+    int pointSize = 1; // Side in pixels of the squares drawn in POINTCLOUD mode
     
 
     Entity();
@@ -34,6 +38,112 @@ public:
 
     virtual void Update(float seconds_elapsed);
     virtual void RenderLab2(Image* framebuffer, Camera* camera, const Color& c);
-    void RenderLab3(Image* framebuffer, Camera* camera, FloatImage* zBuffer);
+    void RenderLab3(Image* framebuffer, Camera* camera, DepthBuffer* zBuffer, const sLighting* lighting = nullptr);
+
+    // Point cloud from the unique positions of the mesh (or its loaded point set), depth tested
+    void RenderPoints(Image* framebuffer, Camera* camera, DepthBuffer* zBuffer, const Color& c);
+    void ProjectPoints(Camera* camera, int width, int height, std::vector<Vector3>& projected);
+
+    // Depth only, for shadow maps: no color, attributes or textures
+    void RenderDepth(FloatImage* depth, Camera* camera);
+    void RenderDepth(DepthBuffer* depth, Camera* camera);
+
+    // Geometry pass of the deferred renderer, writes the entity surface into the G-buffer
+    void RenderDeferred(GBuffer* gbuffer, Camera* camera);
+
+    // Wireframe from the unique edges of the mesh, each one projected and rasterized once
+    void RenderWireframe(Image* framebuffer, Camera* camera, const Color& c);
+
+    // Rasterizes the entity from vertices already projected to screen space (one per mesh vertex),
+    // lit per pixel in TRIANGLES_INTERPOLATED mode when lighting is given
+    void RenderProjected(Image* framebuffer, const std::vector<Vector3>& screenVertices, DepthBuffer* zBuffer, const sLighting* lighting = nullptr);
+
+    // Pixels covered by the projected bounding box of the mesh, false if the box is out of the view volume.
+    // A box crossing the camera plane covers the whole screen
+    bool GetScreenBounds(Camera* camera, int width, int height, int& x0, int& y0, int& x1, int& y1);
+
+    // Projects all the instances that share the same mesh in a single pass over its vertices
+    static void ProjectInstances(const std::vector<Entity*>& instances, Camera* camera, int width, int height, std::vector<std::vector<Vector3>>& screenVertices);
+
+    // Same triangles as RenderProjected in TRIANGLES_INTERPOLATED mode, added to the queue instead of drawn
+    void QueueProjected(RenderQueue* queue, const std::vector<Vector3>& screenVertices, const Vector3& eye, const sLighting* lighting = nullptr);
+
+private:
+    // Screen space triangles with the attributes the interpolated rasterizer needs (world ones only when lit)
+    void BuildTriangles(const std::vector<Vector3>& screenVertices, bool lit, std::vector<sTriangleInfo>& triangles);
+
+    // Rasterizes the mesh edges given the screen position of each wire vertex
+    void DrawEdges(Image* framebuffer, const std::vector<Vector3>& projected, const Color& c);
+
+    // Draws a pointSize square per projected point, in horizontal bands in parallel
+    void SplatPoints(Image* framebuffer, const std::vector<Vector3>& projected, DepthBuffer* zBuffer, const Color& c);
+
+};
+
+// Triangles of one entity already in screen space, with the keys the render queue sorts on
+struct sRenderBatch {
+    Entity* entity = nullptr;
+    Image* texture = nullptr;
+    float depth = 0;        // Squared distance from the camera to the entity origin
+    bool useZBuffer = true;
+    std::vector<sTriangleInfo> triangles;
+};
+
+// Collects the batches of all the entities of a frame and submits them sorted. Depth tested batches
+// go first, grouped by texture so one texture stays in cache and front to back inside each group so
+// the z-buffer rejects the hidden fragments. Batches without z-buffer follow, back to front (painter)
+class RenderQueue {
+public:
+    void Clear();
+    sRenderBatch& Add(Entity* entity, const Vector3& eye);
+
+    // Sorts the batches added since the last flush, draws them and empties the queue
+    void Flush(Image* framebuffer, DepthBuffer* zBuffer, const sLighting* lighting = nullptr);
+    // Same into a multi-sample buffer, which keeps its own per sample depth
+    void Flush(MSAABuffer* framebuffer, const sLighting* lighting = nullptr);
+
+    size_t Size() const { return count; }
+
+private:
+    void Sort();
+
+    std::vector<sRenderBatch> batches; // Only the first count are in use, the rest keep their memory
+    std::vector<int> order;
+    size_t count = 0;
+};
+
+// Remembers what the last frame drew, so a frame where only some entities changed redraws only the
+// tiles under their previous and current screen bounds. The rest keeps the color and depth of the
+// previous frame. Only depth tested interpolated triangles are cached: redrawing one of them over
+// its own pixels fails the depth test, so the entities around the changed tiles can be drawn whole
+class FrameCache {
+public:
+    // Returns false when the frame has to be drawn as usual: no valid previous frame, the camera or the
+    // size changed, or an entity can't be cached. Otherwise clears the tiles under the changed entities
+    // and fills redraw with the entities that overlap them, empty when nothing changed
+    bool Update(RenderTarget& target, Camera* camera, const std::vector<Entity*>& list, std::vector<Entity*>& redraw);
+
+    // Forces a full frame, e.g. after a setting or the lights changed
+    void Invalidate() { valid = false; }
+
+private:
+    struct sEntityState {
+        Entity* entity = nullptr;
+        Mesh* mesh = nullptr;
+        Matrix44 model;
+        eRenderMode mode;
+        bool useZBuffer = true;
+        Image* texture = nullptr;
+        Image* normalMap = nullptr;
+        Image* specularMap = nullptr;
+        bool visible = false;
+        int x0 = 0, y0 = 0, x1 = 0, y1 = 0; // Screen bounds when visible
+    };
 
+    bool valid = false;
+    Matrix44 viewprojection;
+    unsigned int width = 0;
+    unsigned int height = 0;
+    std::vector<sEntityState> states;   // One per entity of the last frame, in the same order
+    std::vector<unsigned char> dirty;   // One per tile of the target
 };
@@ -63,6 +63,26 @@ public:
 
 inline Color operator * (const Color& c, float v) { return Color((unsigned char)(c.r*v), (unsigned char)(c.g*v), (unsigned char)(c.b*v)); }
 inline Color operator * (float v, const Color& c) { return Color((unsigned char)(c.r*v), (unsigned char)(c.g*v), (unsigned char)(c.b*v)); }
+
+// 4 byte color with alpha, one aligned 32 bit word per pixel (see Image::FORMAT_RGBA)
+class ColorRGBA
+{
+public:
+	union
+	{
+		struct { unsigned char r;
+				 unsigned char g;
+				 unsigned char b;
+				 unsigned char a; };
+		unsigned char v[4];
+		unsigned int value;
+	};
+	ColorRGBA() { value = 0; }
+	ColorRGBA(unsigned char r, unsigned char g, unsigned char b, unsigned char a = 255) { this->r = r; this->g = g; this->b = b; this->a = a; }
+	ColorRGBA(const Color& c, unsigned char a = 255) { r = c.r; g = c.g; b = c.b; this->a = a; }
+
+	Color ToColor() const { return Color(r, g, b); }
+};
 //*********************************
 
 class Vector2
@@ -17,10 +17,17 @@ Image::Image() {
     pixels = NULL;
 }
 
-Image::Image(unsigned int width, unsigned int height)
+Image::Image(unsigned int width, unsigned int height, int format)
 {
     this->width = width;
     this->height = height;
+    this->format = format;
+    pixels = NULL;
+    if (format == FORMAT_RGBA) {
+        bytes_per_pixel = 4;
+        pixelsRGBA = new ColorRGBA[width*height];
+        return;
+    }
     pixels = new Color[width*height];
     memset(pixels, 0, width * height * sizeof(Color));
 }
@@ -31,22 +38,32 @@ Image::Image(const Image& c)
     pixels = NULL;
     width = c.width;
     height = c.height;
+    format = c.format;
     bytes_per_pixel = c.bytes_per_pixel;
     if(c.pixels)
     {
         pixels = new Color[width*height];
         memcpy(pixels, c.pixels, width*height*bytes_per_pixel);
     }
+    if(c.pixelsRGBA)
+    {
+        pixelsRGBA = new ColorRGBA[width*height];
+        memcpy(pixelsRGBA, c.pixelsRGBA, width*height*bytes_per_pixel);
+    }
 }
 
 // Assign operator
 Image& Image::operator = (const Image& c)
 {
+    if (this == &c) return *this;
     if(pixels) delete pixels;
+    delete[] pixelsRGBA;
     pixels = NULL;
+    pixelsRGBA = NULL;
 
     width = c.width;
     height = c.height;
+    format = c.format;
     bytes_per_pixel = c.bytes_per_pixel;
 
     if(c.pixels)
@@ -54,6 +71,11 @@ Image& Image::operator = (const Image& c)
         pixels = new Color[width*height*bytes_per_pixel];
         memcpy(pixels, c.pixels, width*height*bytes_per_pixel);
     }
+    if(c.pixelsRGBA)
+    {
+        pixelsRGBA = new ColorRGBA[width*height];
+        memcpy(pixelsRGBA, c.pixelsRGBA, width*height*bytes_per_pixel);
+    }
     return *this;
 }
 
@@ -61,17 +83,74 @@ Image::~Image()
 {
     if(pixels)
         delete pixels;
+    delete[] pixelsRGBA;
 }
 
 void Image::Render()
 {
-    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-    glDrawPixels(width, height, bytes_per_pixel == 3 ? GL_RGB : GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+    // Rows of 32 bit pixels are always 4 byte aligned
+    glPixelStorei(GL_UNPACK_ALIGNMENT, format == FORMAT_RGBA ? 4 : 1);
+    glDrawPixels(width, height, format == FORMAT_RGBA ? GL_RGBA : GL_RGB, GL_UNSIGNED_BYTE, GetBytes());
+}
+
+void Image::SetFormat(int format, unsigned char alpha)
+{
+    if (format == this->format) return;
+
+    unsigned int count = width * height;
+    if (format == FORMAT_RGBA) {
+        pixelsRGBA = count ? new ColorRGBA[count] : NULL;
+        for (unsigned int pos = 0; pos < count; ++pos)
+            pixelsRGBA[pos] = ColorRGBA(pixels[pos], alpha);
+        delete pixels;
+        pixels = NULL;
+        bytes_per_pixel = 4;
+    }
+    else {
+        pixels = count ? new Color[count] : NULL;
+        for (unsigned int pos = 0; pos < count; ++pos)
+            pixels[pos] = pixelsRGBA[pos].ToColor();
+        delete[] pixelsRGBA;
+        pixelsRGBA = NULL;
+        bytes_per_pixel = 3;
+    }
+    this->format = format;
+}
+
+void Image::Fill(const Color& c)
+{
+    unsigned int count = width * height;
+    if (format == FORMAT_RGB) {
+        for (unsigned int pos = 0; pos < count; ++pos)
+            pixels[pos] = c;
+        return;
+    }
+
+    unsigned int value = ColorRGBA(c).value;
+    unsigned int* words = (unsigned int*)pixelsRGBA;
+    #pragma omp simd
+    for (unsigned int pos = 0; pos < count; ++pos)
+        words[pos] = value;
 }
 
 // Change image size (the old one will remain in the top-left corner)
 void Image::Resize(unsigned int width, unsigned int height)
 {
+    if (format == FORMAT_RGBA) {
+        ColorRGBA* new_pixels = new ColorRGBA[width*height];
+        unsigned int min_width = std::min(this->width, width);
+        unsigned int min_height = std::min(this->height, height);
+
+        for (unsigned int y = 0; y < min_height; ++y)
+            memcpy(new_pixels + y * width, pixelsRGBA + y * this->width, min_width * sizeof(ColorRGBA));
+
+        delete[] pixelsRGBA;
+        this->width = width;
+        this->height = height;
+        pixelsRGBA = new_pixels;
+        return;
+    }
+
     Color* new_pixels = new Color[width*height];
     unsigned int min_width = this->width > width ? width : this->width;
     unsigned int min_height = this->height > height ? height : this->height;
@@ -86,9 +165,11 @@ void Image::Resize(unsigned int width, unsigned int height)
     pixels = new_pixels;
 }
 
-// Change image size and scale the content
+// Change image size and scale the content (RGBA images get alpha 255)
 void Image::Scale(unsigned int width, unsigned int height)
 {
+    int oldFormat = format;
+    SetFormat(FORMAT_RGB);
     Color* new_pixels = new Color[width*height];
 
     for(unsigned int x = 0; x < width; ++x)
@@ -99,6 +180,7 @@ void Image::Scale(unsigned int width, unsigned int height)
     this->width = width;
     this->height = height;
     pixels = new_pixels;
+    SetFormat(oldFormat);
 }
 
 Image Image::GetArea(unsigned int start_x, unsigned int start_y, unsigned int width, unsigned int height)
@@ -120,9 +202,9 @@ void Image::FlipY()
 #pragma omp simd
     for (int y = 0; y < height * 0.5; y += 1)
     {
-        Uint8* pos = (Uint8*)pixels + y * row_size;
+        Uint8* pos = GetBytes() + y * row_size;
         memcpy(temp_row, pos, row_size);
-        Uint8* pos2 = (Uint8*)pixels + (height - y - 1) * row_size;
+        Uint8* pos2 = GetBytes() + (height - y - 1) * row_size;
         memcpy(pos, pos2, row_size);
         memcpy(pos2, temp_row, row_size);
     }
@@ -162,6 +244,7 @@ bool Image::LoadPNG(const char* filename, bool flip_y)
     unsigned int originalBytesPerPixel = (unsigned int)bufferSize / (width * height);
     
     // Force 3 channels
+    SetFormat(FORMAT_RGB);
     bytes_per_pixel = 3;
 
     if (originalBytesPerPixel == 3) {
@@ -188,7 +271,7 @@ bool Image::LoadPNG(const char* filename, bool flip_y)
 }
 
 // Loads an image from a TGA file
-bool Image::LoadTGA(const char* filename, bool flip_y)
+bool Image::LoadTGA(const char* filename, bool flip_y, Image* alpha)
 {
     unsigned char TGAheader[12] = {0, 0, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0};
     unsigned char TGAcompare[12];
@@ -244,6 +327,7 @@ bool Image::LoadTGA(const char* filename, bool flip_y)
     fclose(file);
 
     // Save info in image
+    SetFormat(FORMAT_RGB);
     if(pixels)
         delete pixels;
 
@@ -251,6 +335,10 @@ bool Image::LoadTGA(const char* filename, bool flip_y)
     height = tgainfo->height;
     pixels = new Color[width*height];
 
+    bool hasAlpha = alpha && bytesPerPixel == 4;
+    if (hasAlpha)
+        alpha->Resize(width, height);
+
     // Convert to float all pixels
     for (unsigned int y = 0; y < height; ++y) {
         for (unsigned int x = 0; x < width; ++x) {
@@ -258,12 +346,19 @@ bool Image::LoadTGA(const char* filename, bool flip_y)
             // Make sure we don't access out of memory
             if( (pos < imageSize) && (pos + 1 < imageSize) && (pos + 2 < imageSize))
                 SetPixelUnsafe(x, height - y - 1, Color(tgainfo->data[pos + 2], tgainfo->data[pos + 1], tgainfo->data[pos]));
+            if (hasAlpha) {
+                unsigned char a = tgainfo->data[pos + 3];
+                alpha->SetPixelUnsafe(x, height - y - 1, Color(a, a, a));
+            }
         }
     }
 
     // Flip pixels in Y
-    if (flip_y)
+    if (flip_y) {
         FlipY();
+        if (hasAlpha)
+            alpha->FlipY();
+    }
 
     delete tgainfo->data;
     delete tgainfo;
@@ -288,26 +383,29 @@ bool Image::SaveTGA(const char* filename)
     header_short[0] = width;
     header_short[1] = height;
     unsigned char* header = (unsigned char*)header_short;
-    header[4] = 24;
-    header[5] = 0;
+    header[4] = bytes_per_pixel * 8;
+    header[5] = format == FORMAT_RGBA ? 8 : 0; // Alpha bits
 
     fwrite(TGAheader, 1, sizeof(TGAheader), file);
     fwrite(header, 1, 6, file);
 
-    // Convert pixels to unsigned char
-    unsigned char* bytes = new unsigned char[width*height*3];
+    // Convert pixels to unsigned char, TGA stores BGR or BGRA
+    unsigned char* bytes = new unsigned char[width*height*bytes_per_pixel];
     for(unsigned int y = 0; y < height; ++y)
         for(unsigned int x = 0; x < width; ++x)
         {
-            Color c = pixels[y*width+x];
-            unsigned int pos = (y*width+x)*3;
+            Color c = GetPixel(x, y);
+            unsigned int pos = (y*width+x)*bytes_per_pixel;
             bytes[pos+2] = c.r;
             bytes[pos+1] = c.g;
             bytes[pos] = c.b;
+            if (format == FORMAT_RGBA)
+                bytes[pos+3] = pixelsRGBA[y*width+x].a;
         }
 
-    fwrite(bytes, 1, width*height*3, file);
+    fwrite(bytes, 1, width*height*bytes_per_pixel, file);
     fclose(file);
+    delete[] bytes;
 
     return true;
 }
@@ -326,34 +424,157 @@ void Image::DrawRect(int x, int y, int w, int h, const Color& c)
     }
 }
 
+// Kept for the labs, it now uses the integer rasterizer
 void Image::DrawLineDDA(int x0, int y0, int x1, int y1,
     const Color& color) {
-    // Calculate the differences in x and y
+    DrawLine(x0, y0, x1, y1, color);
+}
+
+// Region codes of a point outside the image
+enum { CLIP_INSIDE = 0, CLIP_LEFT = 1, CLIP_RIGHT = 2, CLIP_BOTTOM = 4, CLIP_TOP = 8 };
+
+static int ComputeOutCode(int x, int y, int width, int height) {
+    int code = CLIP_INSIDE;
+    if (x < 0) code |= CLIP_LEFT;
+    else if (x >= width) code |= CLIP_RIGHT;
+    if (y < 0) code |= CLIP_BOTTOM;
+    else if (y >= height) code |= CLIP_TOP;
+    return code;
+}
+
+// floor(a / b) and ceil(a / b) for any signs
+static inline long long FloorDiv(long long a, long long b) { long long q = a / b; return (a % b != 0 && (a < 0) != (b < 0)) ? q - 1 : q; }
+static inline long long CeilDiv(long long a, long long b) { long long q = a / b; return (a % b != 0 && (a < 0) == (b < 0)) ? q + 1 : q; }
+
+// Stores color at count steps of a line from pixel, the minor axis in 16.16 fixed point. P is the pixel
+// type of the image format, so RGBA lines store one word per pixel
+template <typename P>
+static inline void WalkLine(P* pixel, int majorStride, int minorStride, long long minor, long long minorSlope, int count, const P& color)
+{
+    for (int n = 0; n < count; ++n) {
+        *pixel = color;
+        long long next = minor + minorSlope;
+        pixel += majorStride + ((int)(next >> 16) - (int)(minor >> 16)) * minorStride;
+        minor = next;
+    }
+}
+
+void Image::DrawLine(int x0, int y0, int x1, int y1, const Color& color) {
+    // Both ends on the same outer side: nothing to draw. Otherwise the visible part is the range of steps
+    // whose rounded pixel is inside, so the line is clipped without moving its endpoints
+    if (ComputeOutCode(x0, y0, width, height) & ComputeOutCode(x1, y1, width, height)) return;
+
     int dx = x1 - x0;
     int dy = y1 - y0;
-
-    // Determine the number of steps required
     int steps = std::max(abs(dx), abs(dy));
+    if (steps == 0) {
+        SetPixelUnsafe(x0, y0, color);
+        return;
+    }
+
+    // One pixel per step on the major axis, the minor axis in 16.16 fixed point
+    bool xMajor = abs(dx) >= abs(dy);
+    int majorDir = (xMajor ? dx : dy) > 0 ? 1 : -1;
+    long long minorBase = (long long)(xMajor ? y0 : x0) * 65536 + 0x8000; // +0.5 to round
+    long long minorSlope = (long long)(xMajor ? dy : dx) * 65536 / steps;
+
+    auto pixelAt = [&](int n, int& x, int& y) {
+        int major = (xMajor ? x0 : y0) + n * majorDir;
+        int minor = (int)((minorBase + n * minorSlope) >> 16);
+        x = xMajor ? major : minor;
+        y = xMajor ? minor : major;
+    };
+
+    // Steps whose pixel is inside the image, solved on both axes in the fixed point of the walk
+    int majorSize = xMajor ? (int)width : (int)height;
+    int majorStart = xMajor ? x0 : y0;
+    long long first = 0, last = steps;
+    if (majorDir > 0) { first = std::max(first, (long long)-majorStart); last = std::min(last, (long long)majorSize - 1 - majorStart); }
+    else { first = std::max(first, (long long)majorStart - (majorSize - 1)); last = std::min(last, (long long)majorStart); }
+
+    long long minorMax = (long long)(xMajor ? height : width) * 65536 - 1;
+    if (minorSlope > 0) { first = std::max(first, CeilDiv(-minorBase, minorSlope)); last = std::min(last, FloorDiv(minorMax - minorBase, minorSlope)); }
+    else if (minorSlope < 0) { first = std::max(first, CeilDiv(minorMax - minorBase, minorSlope)); last = std::min(last, FloorDiv(-minorBase, minorSlope)); }
+    else if (minorBase < 0 || minorBase > minorMax) return;
+    if (first > last) return;
+    int nStart = (int)first, nEnd = (int)last;
+
+    // Walk the visible steps without any bounds check
+    int x, y;
+    pixelAt(nStart, x, y);
+    int majorStride = xMajor ? majorDir : majorDir * (int)width;
+    int minorStride = xMajor ? (int)width : 1;
+    long long minor = minorBase + nStart * minorSlope;
+
+    if (format == FORMAT_RGBA)
+        WalkLine(pixelsRGBA + y * width + x, majorStride, minorStride, minor, minorSlope, nEnd - nStart + 1, ColorRGBA(color));
+    else
+        WalkLine(pixels + y * width + x, majorStride, minorStride, minor, minorSlope, nEnd - nStart + 1, color);
+}
 
-    // Compute the increment for each step
-    float xIncrement = dx / static_cast<float>(steps);
-    float yIncrement = dy / static_cast<float>(steps);
+// Moves a pixel towards color by coverage in [0,1]. RGBA pixels are read and written as one word and keep their alpha
+static inline void BlendPixel(Color& dst, const Color& color, float coverage)
+{
+    dst.r = (unsigned char)(dst.r + (color.r - dst.r) * coverage);
+    dst.g = (unsigned char)(dst.g + (color.g - dst.g) * coverage);
+    dst.b = (unsigned char)(dst.b + (color.b - dst.b) * coverage);
+}
 
-    // Starting point
-    float x = x0;
-    float y = y0;
+static inline void BlendPixel(ColorRGBA& dst, const Color& color, float coverage)
+{
+    ColorRGBA c = dst;
+    c.r = (unsigned char)(c.r + (color.r - c.r) * coverage);
+    c.g = (unsigned char)(c.g + (color.g - c.g) * coverage);
+    c.b = (unsigned char)(c.b + (color.b - c.b) * coverage);
+    dst.value = c.value;
+}
 
-    // Draw the line
-    for (int i = 0; i <= steps; ++i) {
-        // Set the pixel at the rounded position
-        if (x >= 0 && x < width && y >= 0 && y < height) {
-            SetPixel(static_cast<int>(round(x)),
-                static_cast<int>(round(y)), color);
+void Image::DrawLineAA(float x0, float y0, float x1, float y1, const Color& color) {
+    // Blends the color into a pixel with the given coverage
+    auto plot = [&](int x, int y, float coverage) {
+        if (x < 0 || y < 0 || x >= (int)width || y >= (int)height) return;
+        if (format == FORMAT_RGBA)
+            BlendPixel(pixelsRGBA[y * width + x], color, coverage);
+        else
+            BlendPixel(pixels[y * width + x], color, coverage);
+    };
+
+    bool steep = fabsf(y1 - y0) > fabsf(x1 - x0);
+    if (steep) { std::swap(x0, y0); std::swap(x1, y1); }
+    if (x0 > x1) { std::swap(x0, x1); std::swap(y0, y1); }
+
+    float dx = x1 - x0;
+    float gradient = dx == 0.0f ? 1.0f : (y1 - y0) / dx;
+
+    // Only the columns inside the image are walked
+    int limit = steep ? (int)height : (int)width;
+    int xStart = std::max((int)floorf(x0 + 0.5f), 0);
+    int xEnd = std::min((int)floorf(x1 + 0.5f), limit - 1);
+    float y = y0 + gradient * (xStart - x0);
+
+    for (int x = xStart; x <= xEnd; ++x) {
+        int yi = (int)floorf(y);
+        float f = y - yi;
+        if (steep) {
+            plot(yi, x, 1.0f - f);
+            plot(yi + 1, x, f);
+        }
+        else {
+            plot(x, yi, 1.0f - f);
+            plot(x, yi + 1, f);
         }
+        y += gradient;
+    }
+}
 
-        // Increment x and y
-        x += xIncrement;
-        y += yIncrement;
+void Image::DrawLines(const std::vector<sLineSegment>& lines, const Color& color, bool antialiased) {
+    if (antialiased) {
+        for (const sLineSegment& line : lines)
+            DrawLineAA((float)line.x0, (float)line.y0, (float)line.x1, (float)line.y1, color);
+    }
+    else {
+        for (const sLineSegment& line : lines)
+            DrawLine(line.x0, line.y0, line.x1, line.y1, color);
     }
 }
 
@@ -368,16 +589,31 @@ void Image::ScanLineDDA(int x0, int y0, int x1, int y1,
         std::swap(y0, y1);
     }
 
-    float slope = (float)(x1 - x0) / (y1 - y0); // Slope of the line
-    float x = x0;
+    // Only the rows of the table are walked
+    int firstY = std::max(y0, minY);
+    int lastY = std::min(y1, minY + (int)table.size() - 1);
+    if (firstY > lastY) return;
+
+    // x = x0 + floor(dx * (y - y0) / dy), stepped with an integer error term
+    long long dx = (long long)x1 - x0;
+    long long dy = (long long)y1 - y0;
+    long long q = dx / dy;
+    if (dx % dy != 0 && dx < 0) q--;
+    long long r = dx - q * dy; // 0 <= r < dy
 
-    for (int y = y0; y <= y1; ++y) {
+    long long offset = dx * (firstY - y0);
+    long long x = x0 + offset / dy;
+    long long err = offset % dy;
+    if (err < 0) { x--; err += dy; }
+
+    for (int y = firstY; y <= lastY; ++y) {
         int row = y - minY; // Offset row based on minY
-        if (row >= 0 && row < (int)table.size()) {
-            table[row].first = std::min(table[row].first, (int)x);  // Update minX
-            table[row].second = std::max(table[row].second, (int)x); // Update maxX
-        }
-        x += slope;
+        table[row].first = std::min(table[row].first, (int)x);  // Update minX
+        table[row].second = std::max(table[row].second, (int)x); // Update maxX
+
+        x += q;
+        err += r;
+        if (err >= dy) { x++; err -= dy; }
     }
 }
 
@@ -505,103 +741,817 @@ void Image::DrawTriangle(const Vector2& p0, const Vector2& p1,
     }
 }*/
     
-void Image::DrawTriangleInterpolated(const sTriangleInfo& triangle, FloatImage* zBuffer, bool occlusions) {
+// Triangles crossing the near or far plane are badly projected and no pass draws them. The prepass, the
+// shading passes and the G-buffer all reject them here, or the shading pass would draw fragments the
+// prepass never stored
+static inline bool IsTriangleInDepthRange(const Vector3& p0, const Vector3& p1, const Vector3& p2)
+{
+    return p0.z >= -1 && p0.z <= 1 && p1.z >= -1 && p1.z <= 1 && p2.z >= -1 && p2.z <= 1;
+}
+
+// Visits the pixels covered by a screen space triangle, calling f(x, y, u, v, w, z) with the barycentric
+// coordinates and depth at each one. Only rows rowStart..rowEnd are walked. All the triangle rasterizers go
+// through here so they cover the same pixels with the same depth, which the depth prepass relies on
+template <typename F>
+static inline void ForEachFragment(const Vector3& p0, const Vector3& p1, const Vector3& p2, int width, int rowStart, int rowEnd, F f)
+{
+    if (!IsTriangleInDepthRange(p0, p1, p2)) return;
+
+    float area = (p1.x - p0.x) * (p2.y - p0.y) - (p1.y - p0.y) * (p2.x - p0.x);
+    if (area == 0.0f || !std::isfinite(area)) return;
+    float invArea = 1.0f / area;
+
+    // Bounding box clipped to the target (clamped as floats, the vertices may be far outside)
+    int minX = (int)std::max(0.0f, std::floor(std::min({ p0.x, p1.x, p2.x })));
+    int maxX = (int)std::min((float)(width - 1), std::ceil(std::max({ p0.x, p1.x, p2.x })));
+    int minY = (int)std::max((float)rowStart, std::floor(std::min({ p0.y, p1.y, p2.y })));
+    int maxY = (int)std::min((float)rowEnd, std::ceil(std::max({ p0.y, p1.y, p2.y })));
+
+    for (int y = minY; y <= maxY; ++y) {
+        for (int x = minX; x <= maxX; ++x) {
+            // Barycentric coordinates from the edge functions
+            float u = ((p1.x - x) * (p2.y - y) - (p1.y - y) * (p2.x - x)) * invArea;
+            float v = ((p2.x - x) * (p0.y - y) - (p2.y - y) * (p0.x - x)) * invArea;
+            float w = 1.0f - u - v;
+            if (u < 0 || v < 0 || w < 0) continue;
+
+            f(x, y, u, v, w, p0.z * u + p1.z * v + p2.z * w);
+        }
+    }
+}
+
+// Octahedral encoding: the unit sphere is folded onto a square and stored as two 16 bit values
+static unsigned int PackNormal(const Vector3& n)
+{
+    float sum = fabsf(n.x) + fabsf(n.y) + fabsf(n.z);
+    float x = sum > 0 ? n.x / sum : 0.0f;
+    float y = sum > 0 ? n.y / sum : 0.0f;
+    if (n.z < 0) {
+        float fx = (1.0f - fabsf(y)) * (x >= 0 ? 1.0f : -1.0f);
+        float fy = (1.0f - fabsf(x)) * (y >= 0 ? 1.0f : -1.0f);
+        x = fx;
+        y = fy;
+    }
+    unsigned int ux = (unsigned int)((x * 0.5f + 0.5f) * 65535.0f + 0.5f);
+    unsigned int uy = (unsigned int)((y * 0.5f + 0.5f) * 65535.0f + 0.5f);
+    return ux | (uy << 16);
+}
+
+static Vector3 UnpackNormal(unsigned int packed)
+{
+    float x = (packed & 0xFFFF) * (2.0f / 65535.0f) - 1.0f;
+    float y = (packed >> 16) * (2.0f / 65535.0f) - 1.0f;
+    Vector3 n(x, y, 1.0f - fabsf(x) - fabsf(y));
+    if (n.z < 0) {
+        n.x = (1.0f - fabsf(y)) * (x >= 0 ? 1.0f : -1.0f);
+        n.y = (1.0f - fabsf(x)) * (y >= 0 ? 1.0f : -1.0f);
+    }
+    return n.Normalize();
+}
+
+// Rotates a vector by the upper 3x3 part of a column-major matrix
+static Vector3 RotateByMatrix(const float* m, const Vector3& v)
+{
+    return Vector3(m[0] * v.x + m[4] * v.y + m[8] * v.z,
+                   m[1] * v.x + m[5] * v.y + m[9] * v.z,
+                   m[2] * v.x + m[6] * v.y + m[10] * v.z);
+}
+
+// Same texel lookup as DrawTriangleInterpolated
+static Color SampleNearest(const Image* image, const Vector2& uv)
+{
+    int x = std::min(std::max((int)(uv.x * (image->width - 1)), 0), (int)image->width - 1);
+    int y = std::min(std::max((int)(uv.y * (image->height - 1)), 0), (int)image->height - 1);
+    return image->GetPixel(x, y);
+}
+
+void sLighting::SetLights(const std::vector<sLight>& lights, const std::vector<sShadowMap>* shadows)
+{
+    int n = (int)lights.size();
+    type.resize(n);
+    positionX.resize(n); positionY.resize(n); positionZ.resize(n);
+    directionX.resize(n); directionY.resize(n); directionZ.resize(n);
+    colorR.resize(n); colorG.resize(n); colorB.resize(n);
+    invRadius.resize(n);
+    cosOuter.resize(n); invConeWidth.resize(n);
+    shadowMaps.assign(n, nullptr);
+
+    for (int i = 0; i < n; ++i) {
+        const sLight& light = lights[i];
+        Vector3 direction = light.direction;
+        direction.Normalize();
+
+        type[i] = light.type;
+        positionX[i] = light.position.x;
+        positionY[i] = light.position.y;
+        positionZ[i] = light.position.z;
+        directionX[i] = direction.x;
+        directionY[i] = direction.y;
+        directionZ[i] = direction.z;
+        colorR[i] = light.color.x;
+        colorG[i] = light.color.y;
+        colorB[i] = light.color.z;
+        invRadius[i] = light.radius > 0 ? 1.0f / light.radius : 0.0f;
+
+        // The spot fades in over the outer 20% of its cone
+        if (light.type == sLight::SPOT) {
+            float outer = cosf(light.spotAngle * DEG2RAD);
+            float inner = cosf(light.spotAngle * 0.8f * DEG2RAD);
+            cosOuter[i] = outer;
+            invConeWidth[i] = 1.0f / std::max(inner - outer, 1e-4f);
+        }
+        else {
+            cosOuter[i] = -2.0f;
+            invConeWidth[i] = 1.0f;
+        }
+
+        if (shadows && i < (int)shadows->size() && light.castShadows && (*shadows)[i].valid)
+            shadowMaps[i] = &(*shadows)[i];
+    }
+}
+
+float sShadowMap::Visibility(const Vector3& position) const
+{
+    Vector4 clip = viewprojection * Vector4(position.x, position.y, position.z, 1.0f);
+    if (clip.w <= 0.0f) return 1.0f;
+
+    float invW = 1.0f / clip.w;
+    float z = clip.z * invW;
+    int x = (int)((clip.x * invW + 1.0f) * 0.5f * depth.width);
+    int y = (int)((1.0f - clip.y * invW) * 0.5f * depth.height);
+    if (x < 0 || y < 0 || x >= (int)depth.width || y >= (int)depth.height || z > 1.0f) return 1.0f;
+
+    return z - bias > depth.pixels[y * depth.width + x] ? 0.0f : 1.0f;
+}
+
+// Fragments waiting to be shaded, one array per attribute so the kernel runs over them with SIMD
+static const int SHADE_SPAN = 64;
+struct sShadeSpan {
+    int count = 0;
+    unsigned int pixel[SHADE_SPAN]; // Where the result goes in the framebuffer
+    float px[SHADE_SPAN], py[SHADE_SPAN], pz[SHADE_SPAN];
+    float nx[SHADE_SPAN], ny[SHADE_SPAN], nz[SHADE_SPAN];
+    float albedoR[SHADE_SPAN], albedoG[SHADE_SPAN], albedoB[SHADE_SPAN];
+    float specular[SHADE_SPAN];
+    float outR[SHADE_SPAN], outG[SHADE_SPAN], outB[SHADE_SPAN];
+
+    void Add(unsigned int pos, const Vector3& position, const Vector3& normal, const Color& albedo, float ks) {
+        int i = count++;
+        pixel[i] = pos;
+        px[i] = position.x; py[i] = position.y; pz[i] = position.z;
+        nx[i] = normal.x; ny[i] = normal.y; nz[i] = normal.z;
+        albedoR[i] = albedo.r; albedoG[i] = albedo.g; albedoB[i] = albedo.b;
+        specular[i] = ks;
+    }
+};
+
+// Blinn-Phong for every light on a span of fragments. Lights are the outer loop so the inner loops
+// run over the fragment arrays with no branches and vectorize, each light attribute being a broadcast
+static void ShadeSpan(const sLighting& lighting, sShadeSpan& span)
+{
+    int count = span.count;
+    float vx[SHADE_SPAN], vy[SHADE_SPAN], vz[SHADE_SPAN];
+    float sr[SHADE_SPAN], sg[SHADE_SPAN], sb[SHADE_SPAN];
+    float eyeX = lighting.eye.x, eyeY = lighting.eye.y, eyeZ = lighting.eye.z;
+
+    // Unit normal and view vectors, the diffuse sums start at the ambient term
+    #pragma omp simd
+    for (int i = 0; i < count; ++i) {
+        float invN = 1.0f / sqrtf(std::max(span.nx[i] * span.nx[i] + span.ny[i] * span.ny[i] + span.nz[i] * span.nz[i], 1e-12f));
+        span.nx[i] *= invN; span.ny[i] *= invN; span.nz[i] *= invN;
+
+        float x = eyeX - span.px[i], y = eyeY - span.py[i], z = eyeZ - span.pz[i];
+        float invV = 1.0f / sqrtf(std::max(x * x + y * y + z * z, 1e-12f));
+        vx[i] = x * invV; vy[i] = y * invV; vz[i] = z * invV;
+
+        span.outR[i] = lighting.ambient.x;
+        span.outG[i] = lighting.ambient.y;
+        span.outB[i] = lighting.ambient.z;
+        sr[i] = sg[i] = sb[i] = 0.0f;
+    }
+
+    float shininess = lighting.shininess;
+    float visibility[SHADE_SPAN];
+
+    for (int l = 0; l < lighting.NumLights(); ++l) {
+        float lightR = lighting.colorR[l], lightG = lighting.colorG[l], lightB = lighting.colorB[l];
+        float dirX = lighting.directionX[l], dirY = lighting.directionY[l], dirZ = lighting.directionZ[l];
+        bool directional = lighting.type[l] == sLight::DIRECTIONAL;
+
+        // Shadow lookups are gathers, done apart so the shading loop stays vectorized
+        const sShadowMap* shadowMap = lighting.shadowMaps[l];
+        for (int i = 0; i < count; ++i)
+            visibility[i] = shadowMap ? shadowMap->Visibility(Vector3(span.px[i], span.py[i], span.pz[i])) : 1.0f;
+
+        // A directional light is a point light infinitely far away with no falloff and no cone
+        float lightX = directional ? -dirX * 1e6f : lighting.positionX[l];
+        float lightY = directional ? -dirY * 1e6f : lighting.positionY[l];
+        float lightZ = directional ? -dirZ * 1e6f : lighting.positionZ[l];
+        float invRadius = directional ? 0.0f : lighting.invRadius[l];
+        float cosOuter = lighting.cosOuter[l], invConeWidth = lighting.invConeWidth[l];
+
+        #pragma omp simd
+        for (int i = 0; i < count; ++i) {
+            float lx = lightX - span.px[i], ly = lightY - span.py[i], lz = lightZ - span.pz[i];
+            float distance2 = std::max(lx * lx + ly * ly + lz * lz, 1e-12f);
+            float invDistance = 1.0f / sqrtf(distance2);
+            lx *= invDistance; ly *= invDistance; lz *= invDistance;
+
+            float falloff = std::max(1.0f - distance2 * invDistance * invRadius, 0.0f);
+            float cone = std::min(std::max((-(lx * dirX + ly * dirY + lz * dirZ) - cosOuter) * invConeWidth, 0.0f), 1.0f);
+            falloff *= falloff * cone * visibility[i];
+
+            float NdotL = span.nx[i] * lx + span.ny[i] * ly + span.nz[i] * lz;
+            float diffuse = std::max(NdotL, 0.0f) * falloff;
+
+            float hx = lx + vx[i], hy = ly + vy[i], hz = lz + vz[i];
+            float invH = 1.0f / sqrtf(std::max(hx * hx + hy * hy + hz * hz, 1e-12f));
+            float NdotH = std::max((span.nx[i] * hx + span.ny[i] * hy + span.nz[i] * hz) * invH, 1e-6f);
+            float facing = NdotL > 0.0f ? falloff : 0.0f;
+            float spec = span.specular[i] * facing * expf(shininess * logf(NdotH));
+
+            span.outR[i] += lightR * diffuse; span.outG[i] += lightG * diffuse; span.outB[i] += lightB * diffuse;
+            sr[i] += lightR * spec; sg[i] += lightG * spec; sb[i] += lightB * spec;
+        }
+    }
+
+    // Not clamped here, the 8 bit formats saturate when the fragment is stored
+    #pragma omp simd
+    for (int i = 0; i < count; ++i) {
+        span.outR[i] = span.albedoR[i] * span.outR[i] + 255.0f * sr[i];
+        span.outG[i] = span.albedoG[i] * span.outG[i] + 255.0f * sg[i];
+        span.outB[i] = span.albedoB[i] * span.outB[i] + 255.0f * sb[i];
+    }
+}
+
+// Stores a fragment in the pixel format of the target. The channels are in [0,255] units, the
+// 8 bit formats saturate and HDR scales them to 1 = white keeping what is above
+static inline void StorePixel(Color& p, float r, float g, float b) { p = Color(std::min(r, 255.0f), std::min(g, 255.0f), std::min(b, 255.0f)); }
+static inline void StorePixel(ColorRGBA& p, float r, float g, float b) { p = ColorRGBA(Color(std::min(r, 255.0f), std::min(g, 255.0f), std::min(b, 255.0f))); }
+static inline void StorePixel(sColorHDR& p, float r, float g, float b) { p.r = r * (1.0f / 255.0f); p.g = g * (1.0f / 255.0f); p.b = b * (1.0f / 255.0f); p.a = 1.0f; }
+template <typename P>
+static inline void StorePixel(P& p, const Color& c) { StorePixel(p, (float)c.r, (float)c.g, (float)c.b); }
+static inline void StorePixel(Color& p, const ColorRGBA& c) { p = c.ToColor(); }
+static inline void StorePixel(ColorRGBA& p, const ColorRGBA& c) { p = c; }
+
+// Shades the pending fragments and writes them to the framebuffer (Color, ColorRGBA or sColorHDR pixels)
+template <typename P>
+static void FlushSpan(const sLighting& lighting, sShadeSpan& span, P* pixels)
+{
+    if (span.count == 0) return;
+    ShadeSpan(lighting, span);
+    for (int i = 0; i < span.count; ++i)
+        StorePixel(pixels[span.pixel[i]], span.outR[i], span.outG[i], span.outB[i]);
+    span.count = 0;
+}
+
+// Depth test of one fragment in format F. With DEPTH_LESS the fragment depth is written when it passes.
+// With DEPTH_EQUAL it passes only if it is the depth the prepass stored, which is never written
+template <typename F>
+static inline bool DepthTest(typename F::Type* depth, unsigned int pos, float z, bool depthEqual)
+{
+    typename F::Type d = F::Encode(z);
+    if (depthEqual)
+        return F::Equal(d, depth[pos]);
+    if (d >= depth[pos])
+        return false;
+    depth[pos] = d;
+    return true;
+}
+
+// Surface of the triangle at the barycentric coordinates (u,v,w), queued in the span for the lighting kernel
+static inline void AddLitFragment(sShadeSpan& span, const sTriangleInfo& triangle, unsigned int pos, float u, float v, float w)
+{
+    Vector2 uv(triangle.uv0.x * u + triangle.uv1.x * v + triangle.uv2.x * w,
+               triangle.uv0.y * u + triangle.uv1.y * v + triangle.uv2.y * w);
+
+    Vector3 normal;
+    if (triangle.normalMap && triangle.model) {
+        Color n = SampleNearest(triangle.normalMap, uv);
+        normal = RotateByMatrix(triangle.model, Vector3(n.r / 127.5f - 1.0f, n.g / 127.5f - 1.0f, n.b / 127.5f - 1.0f));
+    }
+    else {
+        normal = triangle.n0 * u + triangle.n1 * v + triangle.n2 * w;
+    }
+
+    Vector3 position = triangle.world0 * u + triangle.world1 * v + triangle.world2 * w;
+    Color albedo = triangle.texture ? SampleNearest(triangle.texture, uv) : triangle.c0 * u + triangle.c1 * v + triangle.c2 * w;
+    float ks = triangle.specularMap ? SampleNearest(triangle.specularMap, uv).r / 255.0f : 0.0f;
+
+    span.Add(pos, position, normal, albedo, ks);
+}
+
+// Vertex colors or texture of the triangle at the barycentric coordinates (u,v,w), no lighting
+static inline Color UnlitColor(const sTriangleInfo& triangle, float u, float v, float w)
+{
+    const Image* texture = triangle.texture;
+    if (texture == nullptr) {
+        // Use interpolated vertex colors when no texture is applied
+        return triangle.c0 * u + triangle.c1 * v + triangle.c2 * w;
+    }
+
+    // Use texture mapping if texture is enabled
+    float texU = triangle.uv0.x * u + triangle.uv1.x * v + triangle.uv2.x * w;
+    float texV = triangle.uv0.y * u + triangle.uv1.y * v + triangle.uv2.y * w;
+    int texX = static_cast<int>(texU * (texture->width - 1));
+    int texY = static_cast<int>(texV * (texture->height - 1));
+    return texture->GetPixelSafe(texX, texY);
+}
+
+// Interpolated triangle with per pixel lighting. Visible fragments are queued and shaded
+// in spans by the lighting kernel. T is an sPixelTarget or HDRImage
+template <typename F, typename T>
+static void DrawTriangleLit(T* target, const sTriangleInfo& triangle, typename F::Type* depth, bool depthEqual, const sLighting& lighting)
+{
+    int width = target->width;
+    int height = target->height;
+
+    sShadeSpan span;
+
+    ForEachFragment(triangle.p0, triangle.p1, triangle.p2, width, 0, height - 1, [&](int x, int y, float u, float v, float w, float z) {
+        unsigned int pos = y * width + x;
+        if (depth && !DepthTest<F>(depth, pos, z, depthEqual)) return;
+
+        AddLitFragment(span, triangle, pos, u, v, w);
+        if (span.count == SHADE_SPAN)
+            FlushSpan(lighting, span, target->pixels);
+    });
+
+    FlushSpan(lighting, span, target->pixels);
+}
+
+// Interpolated triangle with vertex colors or texture, no lighting
+template <typename F, typename T>
+static void DrawTriangleUnlit(T* target, const sTriangleInfo& triangle, typename F::Type* depth, bool depthEqual)
+{
+    int width = target->width;
+    int height = target->height;
+    auto* pixels = target->pixels;
+
+    ForEachFragment(triangle.p0, triangle.p1, triangle.p2, width, 0, height - 1, [&](int x, int y, float u, float v, float w, float z) {
+        unsigned int pos = y * width + x;
+        if (depth && !DepthTest<F>(depth, pos, z, depthEqual)) return;
+
+        StorePixel(pixels[pos], UnlitColor(triangle, u, v, w));
+    });
+}
+
+template <typename F, typename T>
+static void DrawTriangleFormat(T* target, const sTriangleInfo& triangle, typename F::Type* depth, bool depthEqual, const sLighting* lighting)
+{
+    if (lighting)
+        DrawTriangleLit<F>(target, triangle, depth, depthEqual, *lighting);
+    else
+        DrawTriangleUnlit<F>(target, triangle, depth, depthEqual);
+}
+
+// The pixels of an Image in its format, with what the rasterizers and resolves read of the image. Each
+// format gets its own instantiation, so the inner loops store Color or ColorRGBA without branching
+template <typename P>
+struct sPixelTarget {
+    P* pixels;
+    unsigned int width;
+    unsigned int height;
+    int depthFunc;
+};
+
+template <typename P>
+static sPixelTarget<P> GetPixelTarget(const Image* image, P* pixels)
+{
+    sPixelTarget<P> target = { pixels, image->width, image->height, image->depthFunc };
+    return target;
+}
+
+// Picks the rasterizer for the depth format of the z-buffer
+template <typename T>
+static void DrawTriangleDepth(T* target, const sTriangleInfo& triangle, DepthBuffer* zBuffer, bool occlusions, const sLighting* lighting)
+{
+    bool useDepth = occlusions && zBuffer && zBuffer->width == target->width && zBuffer->height == target->height;
+    bool depthEqual = target->depthFunc == Image::DEPTH_EQUAL;
+
+    // After a depth prepass (DEPTH_EQUAL) only the nearest fragment is shaded
+    switch (useDepth ? zBuffer->format : -1) {
+        case DepthBuffer::DEPTH16:  DrawTriangleFormat<sDepth16>(target, triangle, zBuffer->Data<sDepth16>(), depthEqual, lighting); break;
+        case DepthBuffer::DEPTH24:  DrawTriangleFormat<sDepth24>(target, triangle, zBuffer->Data<sDepth24>(), depthEqual, lighting); break;
+        case DepthBuffer::DEPTH32F: DrawTriangleFormat<sDepth32F>(target, triangle, zBuffer->Data<sDepth32F>(), depthEqual, lighting); break;
+        default:                    DrawTriangleFormat<sDepth32F>(target, triangle, nullptr, depthEqual, lighting); break;
+    }
+}
+
+void Image::DrawTriangleInterpolated(const sTriangleInfo& triangle, DepthBuffer* zBuffer, bool occlusions, const sLighting* lighting) {
+    if (format == FORMAT_RGBA) {
+        sPixelTarget<ColorRGBA> target = GetPixelTarget(this, pixelsRGBA);
+        DrawTriangleDepth(&target, triangle, zBuffer, occlusions, lighting);
+    }
+    else {
+        sPixelTarget<Color> target = GetPixelTarget(this, pixels);
+        DrawTriangleDepth(&target, triangle, zBuffer, occlusions, lighting);
+    }
+}
+
+template <typename P>
+static void DrawTriangles(sPixelTarget<P> target, const std::vector<sTriangleInfo>& triangles, DepthBuffer* zBuffer, bool occlusions, const sLighting* lighting)
+{
+    for (size_t i = 0; i < triangles.size(); ++i)
+        DrawTriangleDepth(&target, triangles[i], zBuffer, occlusions, lighting);
+}
+
+// Rasterizes a batch of triangles (e.g. all the triangles of one instance)
+void Image::DrawTrianglesInterpolated(const std::vector<sTriangleInfo>& triangles, DepthBuffer* zBuffer, bool occlusions, const sLighting* lighting) {
+    if (format == FORMAT_RGBA)
+        DrawTriangles(GetPixelTarget(this, pixelsRGBA), triangles, zBuffer, occlusions, lighting);
+    else
+        DrawTriangles(GetPixelTarget(this, pixels), triangles, zBuffer, occlusions, lighting);
+}
+
+
+//---------------------------------------------------------------------
+// HDRImage
+
+HDRImage::HDRImage(unsigned int width, unsigned int height)
+{
+    this->width = width;
+    this->height = height;
+    pixels = new sColorHDR[width * height]();
+}
+
+// Copy constructor
+HDRImage::HDRImage(const HDRImage& c)
+{
+    pixels = NULL;
+    width = c.width;
+    height = c.height;
+    if (c.pixels)
+    {
+        pixels = new sColorHDR[width * height];
+        memcpy(pixels, c.pixels, width * height * sizeof(sColorHDR));
+    }
+}
+
+// Assign operator
+HDRImage& HDRImage::operator = (const HDRImage& c)
+{
+    if (this == &c) return *this;
+    delete[] pixels;
+    pixels = NULL;
+
+    width = c.width;
+    height = c.height;
+    depthFunc = c.depthFunc;
+    if (c.pixels)
+    {
+        pixels = new sColorHDR[width * height];
+        memcpy(pixels, c.pixels, width * height * sizeof(sColorHDR));
+    }
+    return *this;
+}
+
+HDRImage::~HDRImage()
+{
+    delete[] pixels;
+}
+
+void HDRImage::Resize(unsigned int width, unsigned int height)
+{
+    if (width == this->width && height == this->height) return;
+
+    delete[] pixels;
+    this->width = width;
+    this->height = height;
+    pixels = new sColorHDR[width * height]();
+}
+
+void HDRImage::Fill(const sColorHDR& c)
+{
+    int count = width * height;
+
+    #pragma omp parallel for
+    for (int pos = 0; pos < count; ++pos)
+        pixels[pos] = c;
+}
+
+void HDRImage::Accumulate(const HDRImage& src, float weight)
+{
+    if (src.width != width || src.height != height) return;
+
+    // The pixels are 4 packed floats, added as one flat array
+    float* d = (float*)pixels;
+    const float* s = (const float*)src.pixels;
+    int count = width * height * 4;
+
+    #pragma omp parallel for simd
+    for (int i = 0; i < count; ++i)
+        d[i] += s[i] * weight;
+}
+
+void HDRImage::DrawTriangleInterpolated(const sTriangleInfo& triangle, DepthBuffer* zBuffer, bool occlusions, const sLighting* lighting) {
+    DrawTriangleDepth(this, triangle, zBuffer, occlusions, lighting);
+}
+
+void HDRImage::DrawTrianglesInterpolated(const std::vector<sTriangleInfo>& triangles, DepthBuffer* zBuffer, bool occlusions, const sLighting* lighting) {
+    for (size_t i = 0; i < triangles.size(); ++i)
+        DrawTriangleDepth(this, triangles[i], zBuffer, occlusions, lighting);
+}
+
+// Tone mapping curves, from linear [0,inf) to [0,1]
+template <int TONEMAP>
+static inline float ToneMapChannel(float x)
+{
+    if (TONEMAP == HDRImage::TONEMAP_REINHARD)
+        return x / (1.0f + x);
+    if (TONEMAP == HDRImage::TONEMAP_ACES) // Narkowicz fit of the ACES filmic curve
+        return std::min((x * (2.51f * x + 0.03f)) / (x * (2.43f * x + 0.59f) + 0.14f), 1.0f);
+    return std::min(x, 1.0f);
+}
+
+static const int TONEMAP_SPAN = 64;
+
+// One curve per instantiation, so the inner loop has no branches and runs with SIMD. Each row is
+// mapped in spans to float arrays and then stored in the 8 bit format of the target
+template <int TONEMAP, typename T>
+static void ToneMapRows(const HDRImage& src, T* target, float exposure, float gamma)
+{
+    int width = src.width;
+    int height = src.height;
+    float invGamma = 1.0f / gamma;
+
+    #pragma omp parallel for
+    for (int y = 0; y < height; ++y) {
+        const sColorHDR* in = src.pixels + y * width;
+        auto* out = target->pixels + y * width;
+        float r[TONEMAP_SPAN], g[TONEMAP_SPAN], b[TONEMAP_SPAN];
+
+        for (int x0 = 0; x0 < width; x0 += TONEMAP_SPAN) {
+            int count = std::min(TONEMAP_SPAN, width - x0);
+
+            // Gamma as exp(log(x) / gamma), x is kept above 0 so the log is finite
+            #pragma omp simd
+            for (int i = 0; i < count; ++i) {
+                const sColorHDR& c = in[x0 + i];
+                float tr = ToneMapChannel<TONEMAP>(std::max(c.r * exposure, 0.0f));
+                float tg = ToneMapChannel<TONEMAP>(std::max(c.g * exposure, 0.0f));
+                float tb = ToneMapChannel<TONEMAP>(std::max(c.b * exposure, 0.0f));
+                r[i] = 255.0f * expf(invGamma * logf(std::max(tr, 1e-10f))) + 0.5f;
+                g[i] = 255.0f * expf(invGamma * logf(std::max(tg, 1e-10f))) + 0.5f;
+                b[i] = 255.0f * expf(invGamma * logf(std::max(tb, 1e-10f))) + 0.5f;
+            }
+
+            for (int i = 0; i < count; ++i)
+                StorePixel(out[x0 + i], r[i], g[i], b[i]);
+        }
+    }
+}
+
+template <typename T>
+static void ToneMap(const HDRImage& src, T* target, int toneMap, float exposure, float gamma)
+{
+    if (target->width != src.width || target->height != src.height) return;
+
+    switch (toneMap) {
+        case HDRImage::TONEMAP_REINHARD: ToneMapRows<HDRImage::TONEMAP_REINHARD>(src, target, exposure, gamma); break;
+        case HDRImage::TONEMAP_ACES:     ToneMapRows<HDRImage::TONEMAP_ACES>(src, target, exposure, gamma); break;
+        default:                         ToneMapRows<HDRImage::TONEMAP_CLAMP>(src, target, exposure, gamma); break;
+    }
+}
+
+void HDRImage::Resolve(Image* target, int toneMap, float exposure, float gamma) const
+{
+    if (target->format == Image::FORMAT_RGBA) {
+        sPixelTarget<ColorRGBA> pixels = GetPixelTarget(target, target->pixelsRGBA);
+        ToneMap(*this, &pixels, toneMap, exposure, gamma);
+    }
+    else {
+        sPixelTarget<Color> pixels = GetPixelTarget(target, target->pixels);
+        ToneMap(*this, &pixels, toneMap, exposure, gamma);
+    }
+}
+
+const char* HDRImage::GetToneMapName(int toneMap)
+{
+    switch (toneMap) {
+        case TONEMAP_REINHARD: return "Reinhard";
+        case TONEMAP_ACES:     return "ACES";
+        default:               return "clamp";
+    }
+}
+
+
+//---------------------------------------------------------------------
+// MSAABuffer
+
+// Sample positions in 1/16 of a pixel from the pixel center, the usual 2x, 4x and 8x patterns
+static const signed char MSAA_PATTERN_2[2][2] = { { 4, 4 }, { -4, -4 } };
+static const signed char MSAA_PATTERN_4[4][2] = { { -2, -6 }, { 6, -2 }, { -6, 2 }, { 2, 6 } };
+static const signed char MSAA_PATTERN_8[8][2] = { { 1, -3 }, { -1, 3 }, { 5, 1 }, { -3, -5 }, { -5, 5 }, { -7, -1 }, { 3, 7 }, { 7, -7 } };
+
+void MSAABuffer::Resize(unsigned int width, unsigned int height, int samples)
+{
+    samples = samples >= 8 ? 8 : (samples >= 4 ? 4 : 2);
+    if (width == this->width && height == this->height && samples == this->samples && coverage.size() == width * height)
+        return;
+
+    this->width = width;
+    this->height = height;
+    this->samples = samples;
+    depth.Resize(width * samples, height);
+    color.assign(width * height * samples, ColorRGBA());
+    coverage.assign(width * height, 0);
+    mixed.assign(width * height, 0);
+}
+
+// Every sample of a pixel takes the depth stored for the pixel in format F
+template <typename F>
+static void SeedSampleDepth(float* sampleDepth, const typename F::Type* seed, int count, int samples)
+{
+    #pragma omp parallel for
+    for (int pos = 0; pos < count; ++pos) {
+        float z = F::Decode(seed[pos]);
+        for (int s = 0; s < samples; ++s)
+            sampleDepth[pos * samples + s] = z;
+    }
+}
+
+void MSAABuffer::Clear(const DepthBuffer* seed)
+{
+    if (coverage.empty())
+        return;
+    memset(&coverage[0], 0, coverage.size());
+
+    if (!seed || seed->width != width || seed->height != height) {
+        depth.Fill(1.0f);
+        return;
+    }
+    int count = width * height;
+    switch (seed->format) {
+        case DepthBuffer::DEPTH16: SeedSampleDepth<sDepth16>(depth.pixels, seed->Data<sDepth16>(), count, samples); break;
+        case DepthBuffer::DEPTH24: SeedSampleDepth<sDepth24>(depth.pixels, seed->Data<sDepth24>(), count, samples); break;
+        default:                   SeedSampleDepth<sDepth32F>(depth.pixels, seed->Data<sDepth32F>(), count, samples); break;
+    }
+}
+
+void MSAABuffer::DrawTriangleInterpolated(const sTriangleInfo& triangle, bool occlusions, const sLighting* lighting)
+{
     const Vector3& p0 = triangle.p0;
     const Vector3& p1 = triangle.p1;
     const Vector3& p2 = triangle.p2;
-    const Vector2& uv0 = triangle.uv0;
-    const Vector2& uv1 = triangle.uv1;
-    const Vector2& uv2 = triangle.uv2;
-    const Color& c0 = triangle.c0;
-    const Color& c1 = triangle.c1;
-    const Color& c2 = triangle.c2;
-    Image* texture = triangle.texture;
-
-    // Step 1: Sort vertices by Y-coordinate to find minY
-    int minY = std::min({(int)p0.y, (int)p1.y, (int)p2.y});
-    int maxY = std::max({(int)p0.y, (int)p1.y, (int)p2.y});
-
-    // Step 2: Create the table
-    std::vector<std::pair<int, int>> table(maxY - minY + 1, {INT_MAX, INT_MIN});
-
-    // Step 3: Use ScanLineDDA to populate the table
-    ScanLineDDA((int)p0.x, (int)p0.y, (int)p1.x, (int)p1.y, table, minY);
-    ScanLineDDA((int)p1.x, (int)p1.y, (int)p2.x, (int)p2.y, table, minY);
-    ScanLineDDA((int)p2.x, (int)p2.y, (int)p0.x, (int)p0.y, table, minY);
-
-    // Step 4: Iterate through the filled area
-    for (int i = 0; i < (int)table.size(); ++i) {
-        if (table[i].first <= table[i].second) {
-            int y = minY + i;
-            for (int x = table[i].first; x <= table[i].second; ++x) {
-                Vector3 p(x, y, 0.0f);
-
-                // Compute barycentric coordinates
-                Vector3 v0 = p1 - p0;
-                Vector3 v1 = p2 - p0;
-                Vector3 vp = p - p0;
-                Vector3 v2 = p1 - p2;
-                Vector3 vp2 = p - p1;
-
-                float area = (v0.Cross(v1).Length()) / 2.0f;
-                float area0 = (v2.Cross(vp2).Length()) / 2.0f;
-                float area1 = (vp.Cross(v1).Length()) / 2.0f;
-                float area2 = (v0.Cross(vp).Length()) / 2.0f;
-
-                float u = area0 / area;
-                float v = area1 / area;
-                float w = area2 / area;
-
-                float sum = u + v + w;
-                u /= sum;
-                v /= sum;
-                w /= sum;
-
-                float z = p0.z * u + p1.z * v + p2.z * w;
-
-                if (u >= 0 && v >= 0 && w >= 0) {
-                    if (occlusions) {
-                        float currentDepth = zBuffer->GetPixelSafe(x, y);
-                        if (z < currentDepth) {
-                            Color color;
-
-                            // Check if the entity should be rendered with a texture or colors
-                            if (texture == nullptr) {
-                                // Use interpolated vertex colors when no texture is applied
-                                color = c0 * u + c1 * v + c2 * w;
-                            } else {
-                                // Use texture mapping if texture is enabled
-                                float texU = uv0.x * u + uv1.x * v + uv2.x * w;
-                                float texV = uv0.y * u + uv1.y * v + uv2.y * w;
-                                int texX = static_cast<int>(texU * (texture->width - 1));
-                                int texY = static_cast<int>(texV * (texture->height - 1));
-                                color = texture->GetPixelSafe(texX, texY);
-                            }
-
-                            SetPixel(x, y, color);
-                            zBuffer->SetPixel(x, y, z);
-                        }
-                    } else {
-                        Color color;
-
-                        if (texture == nullptr) {
-                            // Show colored triangles if texture is disabled
-                            color = c0 * u + c1 * v + c2 * w;
-                        } else {
-                            // Show textured triangles otherwise
-                            float texU = uv0.x * u + uv1.x * v + uv2.x * w;
-                            float texV = uv0.y * u + uv1.y * v + uv2.y * w;
-                            int texX = static_cast<int>(texU * (texture->width - 1));
-                            int texY = static_cast<int>(texV * (texture->height - 1));
-                            color = texture->GetPixelSafe(texX, texY);
-                        }
-
-                        SetPixel(x, y, color);
-                    }
+    if (!IsTriangleInDepthRange(p0, p1, p2)) return;
+    float area = (p1.x - p0.x) * (p2.y - p0.y) - (p1.y - p0.y) * (p2.x - p0.x);
+    if (area == 0.0f || !std::isfinite(area) || coverage.size() != width * height) return;
+    float invArea = 1.0f / area;
+
+    // The barycentric coordinates and the depth are affine in screen space, so each sample
+    // is the value at the pixel center plus a constant offset
+    int S = samples;
+    unsigned int full = (1u << S) - 1;
+    const signed char (*pattern)[2] = S == 2 ? MSAA_PATTERN_2 : (S == 8 ? MSAA_PATTERN_8 : MSAA_PATTERN_4);
+    float dudx = (p1.y - p2.y) * invArea, dudy = (p2.x - p1.x) * invArea;
+    float dvdx = (p2.y - p0.y) * invArea, dvdy = (p0.x - p2.x) * invArea;
+    float offU[8], offV[8], offZ[8];
+    for (int s = 0; s < S; ++s) {
+        float ox = pattern[s][0] / 16.0f, oy = pattern[s][1] / 16.0f;
+        offU[s] = dudx * ox + dudy * oy;
+        offV[s] = dvdx * ox + dvdy * oy;
+        offZ[s] = (p0.z - p2.z) * offU[s] + (p1.z - p2.z) * offV[s];
+    }
+
+    // Bounding box grown by half a pixel for the samples, clipped to the buffer
+    int minX = (int)std::max(0.0f, std::floor(std::min({ p0.x, p1.x, p2.x }) - 0.5f));
+    int maxX = (int)std::min((float)width - 1.0f, std::ceil(std::max({ p0.x, p1.x, p2.x }) + 0.5f));
+    int minY = (int)std::max(0.0f, std::floor(std::min({ p0.y, p1.y, p2.y }) - 0.5f));
+    int maxY = (int)std::min((float)height - 1.0f, std::ceil(std::max({ p0.y, p1.y, p2.y }) + 0.5f));
+
+    // A pixel covered at once keeps a single color, a partial write makes it an edge pixel
+    auto store = [&](unsigned int pos, unsigned int mask, const ColorRGBA& c) {
+        ColorRGBA* sampleColor = &color[pos * S];
+        for (int s = 0; s < S; ++s)
+            if (mask >> s & 1)
+                sampleColor[s] = c;
+        mixed[pos] = mask != full;
+        coverage[pos] |= mask;
+    };
+
+    sShadeSpan span;
+    unsigned char masks[SHADE_SPAN];
+    auto flush = [&]() {
+        if (span.count == 0) return;
+        ShadeSpan(*lighting, span);
+        for (int i = 0; i < span.count; ++i) {
+            ColorRGBA c;
+            StorePixel(c, span.outR[i], span.outG[i], span.outB[i]);
+            store(span.pixel[i], masks[i], c);
+        }
+        span.count = 0;
+    };
+
+    for (int y = minY; y <= maxY; ++y) {
+        for (int x = minX; x <= maxX; ++x) {
+            float u = ((p1.x - x) * (p2.y - y) - (p1.y - y) * (p2.x - x)) * invArea;
+            float v = ((p2.x - x) * (p0.y - y) - (p2.y - y) * (p0.x - x)) * invArea;
+            float z = p0.z * u + p1.z * v + p2.z * (1.0f - u - v);
+
+            // Coverage and depth test per sample
+            unsigned int pos = y * width + x;
+            float* sampleDepth = depth.pixels + pos * S;
+            unsigned int mask = 0;
+            for (int s = 0; s < S; ++s) {
+                float su = u + offU[s], sv = v + offV[s];
+                if (su < 0 || sv < 0 || su + sv > 1.0f) continue;
+
+                // Drawn without depth the sample keeps the one it had, anything in front may still cover it
+                if (occlusions) {
+                    float sz = z + offZ[s];
+                    if (sz >= sampleDepth[s]) continue;
+                    sampleDepth[s] = sz;
                 }
+                mask |= 1u << s;
+            }
+            if (mask == 0) continue;
+
+            // Shaded once, at the pixel center or at the first covered sample when the center is outside
+            float w = 1.0f - u - v;
+            if (u < 0 || v < 0 || w < 0) {
+                int s = 0;
+                while (!((mask >> s) & 1)) ++s;
+                u += offU[s]; v += offV[s]; w = 1.0f - u - v;
+            }
+
+            if (lighting) {
+                masks[span.count] = (unsigned char)mask;
+                AddLitFragment(span, triangle, pos, u, v, w);
+                if (span.count == SHADE_SPAN)
+                    flush();
+            }
+            else {
+                store(pos, mask, ColorRGBA(UnlitColor(triangle, u, v, w)));
             }
         }
     }
+
+    if (lighting)
+        flush();
+}
+
+void MSAABuffer::DrawTrianglesInterpolated(const std::vector<sTriangleInfo>& triangles, bool occlusions, const sLighting* lighting)
+{
+    for (size_t i = 0; i < triangles.size(); ++i)
+        DrawTriangleInterpolated(triangles[i], occlusions, lighting);
+}
+
+// The color of a pixel of either 8 bit format
+static inline Color LoadPixel(const Color& p) { return p; }
+static inline Color LoadPixel(const ColorRGBA& p) { return p.ToColor(); }
+
+// Resolve of the samples into pixels of type P (Color or ColorRGBA). A fully covered RGBA pixel is a single
+// word copy of its first sample
+template <typename P>
+static void ResolveSamples(const MSAABuffer& msaa, P* pixels)
+{
+    unsigned int width = msaa.width;
+    unsigned int height = msaa.height;
+    const std::vector<ColorRGBA>& color = msaa.color;
+    const std::vector<unsigned char>& coverage = msaa.coverage;
+    const std::vector<unsigned char>& mixed = msaa.mixed;
+
+    int S = msaa.samples;
+    unsigned int full = (1u << S) - 1;
+    int shift = S == 2 ? 1 : (S == 4 ? 2 : 3);
+    unsigned int half = S / 2;
+
+    #pragma omp parallel for
+    for (int y = 0; y < (int)height; ++y) {
+        for (int x = 0; x < (int)width; ++x) {
+            unsigned int pos = y * width + x;
+            unsigned int drawn = coverage[pos];
+            if (drawn == 0) continue;
+
+            // Fast path: one triangle covered the whole pixel
+            const ColorRGBA* sampleColor = &color[pos * S];
+            if (drawn == full && !mixed[pos]) {
+                StorePixel(pixels[pos], sampleColor[0]);
+                continue;
+            }
+
+            Color background = LoadPixel(pixels[pos]);
+            unsigned int r = 0, g = 0, b = 0;
+            for (int s = 0; s < S; ++s) {
+                const bool isDrawn = (drawn >> s) & 1;
+                r += isDrawn ? sampleColor[s].r : background.r;
+                g += isDrawn ? sampleColor[s].g : background.g;
+                b += isDrawn ? sampleColor[s].b : background.b;
+            }
+            StorePixel(pixels[pos], Color((float)((r + half) >> shift), (float)((g + half) >> shift), (float)((b + half) >> shift)));
+        }
+    }
+}
+
+void MSAABuffer::Resolve(Image* target) const
+{
+    if (target->width != width || target->height != height || coverage.size() != width * height) return;
+
+    if (target->format == Image::FORMAT_RGBA)
+        ResolveSamples(*this, target->pixelsRGBA);
+    else
+        ResolveSamples(*this, target->pixels);
 }
 
 
@@ -678,3 +1628,359 @@ void ForEachPixel(Image& img, const Image& img2, F f) {
         pixels = new_pixels;
     }
 
+// Nearest depth of a triangle soup in format F. Every band of rows walks the triangle list and keeps only
+// the rows it owns, so no two threads write the same pixel
+template <typename F>
+static void RasterizeDepthBands(typename F::Type* depth, int width, int height, const std::vector<Vector3>& screenVertices)
+{
+    const int bandHeight = 32;
+    int numBands = (height + bandHeight - 1) / bandHeight;
+    int numTriangles = (int)screenVertices.size() / 3;
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int band = 0; band < numBands; ++band) {
+        int bandY0 = band * bandHeight;
+        int bandY1 = std::min(bandY0 + bandHeight, height) - 1;
+
+        for (int t = 0; t < numTriangles; ++t) {
+            const Vector3& p0 = screenVertices[t * 3];
+            const Vector3& p1 = screenVertices[t * 3 + 1];
+            const Vector3& p2 = screenVertices[t * 3 + 2];
+            ForEachFragment(p0, p1, p2, width, bandY0, bandY1, [&](int x, int y, float, float, float, float z) {
+                typename F::Type d = F::Encode(z);
+                typename F::Type& stored = depth[y * width + x];
+                if (d < stored)
+                    stored = d;
+            });
+        }
+    }
+}
+
+    void FloatImage::RasterizeDepth(const std::vector<Vector3>& screenVertices)
+    {
+        RasterizeDepthBands<sDepth32F>(pixels, width, height, screenVertices);
+    }
+
+DepthBuffer::DepthBuffer(unsigned int width, unsigned int height, int format)
+{
+    this->format = format;
+    Resize(width, height);
+}
+
+DepthBuffer::~DepthBuffer()
+{
+    delete[] data;
+}
+
+void DepthBuffer::Resize(unsigned int width, unsigned int height)
+{
+    if (data && this->width == width && this->height == height)
+        return;
+
+    delete[] data;
+    this->width = width;
+    this->height = height;
+    data = new unsigned char[width * height * BytesPerPixel()];
+    Clear();
+}
+
+void DepthBuffer::SetFormat(int format)
+{
+    if (this->format == format)
+        return;
+
+    // Reallocate only when the word size changes. The old words mean nothing in the new format
+    bool sameSize = BytesPerPixel() == (format == DEPTH16 ? 2u : 4u);
+    this->format = format;
+    if (!sameSize) {
+        delete[] data;
+        data = nullptr;
+        Resize(width, height);
+    }
+    else if (data) {
+        Clear();
+    }
+}
+
+unsigned int DepthBuffer::BytesPerPixel() const
+{
+    return format == DEPTH16 ? 2 : 4;
+}
+
+const char* DepthBuffer::GetFormatName() const
+{
+    switch (format) {
+        case DEPTH16: return "16-bit unorm";
+        case DEPTH24: return "24-bit unorm";
+        default:      return "32-bit float";
+    }
+}
+
+void DepthBuffer::Clear(float z)
+{
+    unsigned int size = width * height;
+    switch (format) {
+        case DEPTH16:  std::fill(Data<sDepth16>(), Data<sDepth16>() + size, sDepth16::Encode(z)); break;
+        case DEPTH24:  std::fill(Data<sDepth24>(), Data<sDepth24>() + size, sDepth24::Encode(z)); break;
+        default:       std::fill(Data<sDepth32F>(), Data<sDepth32F>() + size, sDepth32F::Encode(z)); break;
+    }
+}
+
+template <typename F>
+static void FillDepthRect(typename F::Type* data, unsigned int stride, unsigned int x, unsigned int y, unsigned int w, unsigned int h, float z)
+{
+    typename F::Type value = F::Encode(z);
+    for (unsigned int row = y; row < y + h; ++row)
+        std::fill(data + row * stride + x, data + row * stride + x + w, value);
+}
+
+void DepthBuffer::ClearRect(unsigned int x, unsigned int y, unsigned int w, unsigned int h, float z)
+{
+    switch (format) {
+        case DEPTH16:  FillDepthRect<sDepth16>(Data<sDepth16>(), width, x, y, w, h, z); break;
+        case DEPTH24:  FillDepthRect<sDepth24>(Data<sDepth24>(), width, x, y, w, h, z); break;
+        default:       FillDepthRect<sDepth32F>(Data<sDepth32F>(), width, x, y, w, h, z); break;
+    }
+}
+
+float DepthBuffer::GetDepth(unsigned int x, unsigned int y) const
+{
+    unsigned int pos = y * width + x;
+    switch (format) {
+        case DEPTH16:  return sDepth16::Decode(reinterpret_cast<const sDepth16::Type*>(data)[pos]);
+        case DEPTH24:  return sDepth24::Decode(reinterpret_cast<const sDepth24::Type*>(data)[pos]);
+        default:       return sDepth32F::Decode(reinterpret_cast<const sDepth32F::Type*>(data)[pos]);
+    }
+}
+
+void DepthBuffer::RasterizeDepth(const std::vector<Vector3>& screenVertices)
+{
+    switch (format) {
+        case DEPTH16:  RasterizeDepthBands<sDepth16>(Data<sDepth16>(), width, height, screenVertices); break;
+        case DEPTH24:  RasterizeDepthBands<sDepth24>(Data<sDepth24>(), width, height, screenVertices); break;
+        default:       RasterizeDepthBands<sDepth32F>(Data<sDepth32F>(), width, height, screenVertices); break;
+    }
+}
+
+void RenderTarget::Resize(unsigned int width, unsigned int height)
+{
+    if (color.width != width || color.height != height)
+        color.Resize(width, height);
+    depth.Resize(width, height);
+
+    // Unknown contents, everything is cleared on the next use
+    tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+    tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+    tiles.assign(tilesX * tilesY, TILE_PENDING);
+}
+
+void RenderTarget::Clear(const Color& c, float z)
+{
+    // Someone resized one of the buffers directly
+    if (depth.width != color.width || depth.height != color.height || (int)tiles.size() != tilesX * tilesY ||
+        tilesX != (int)(color.width + TILE_SIZE - 1) / TILE_SIZE || tilesY != (int)(color.height + TILE_SIZE - 1) / TILE_SIZE)
+        Resize(color.width, color.height);
+
+    bool sameValues = clearRow.size() == TILE_SIZE && c.r == clearColor.r && c.g == clearColor.g && c.b == clearColor.b && z == clearDepth;
+    if (!sameValues) {
+        clearColor = c;
+        clearDepth = z;
+        clearRow.assign(TILE_SIZE, c);
+    }
+
+    for (unsigned char& tile : tiles) {
+        if (tile == TILE_DRAWN || !sameValues)
+            tile = TILE_PENDING;
+    }
+}
+
+void RenderTarget::SetDepthFormat(int format)
+{
+    depth.SetFormat(format);
+    std::fill(tiles.begin(), tiles.end(), (unsigned char)TILE_PENDING);
+}
+
+void RenderTarget::SetColorFormat(int format)
+{
+    color.SetFormat(format);
+    std::fill(tiles.begin(), tiles.end(), (unsigned char)TILE_PENDING);
+}
+
+void RenderTarget::ClearTiles(const std::vector<int>& list)
+{
+    int width = color.width;
+    int height = color.height;
+    bool rgba = color.format == Image::FORMAT_RGBA;
+    bool gray = clearColor.r == clearColor.g && clearColor.g == clearColor.b;
+    ColorRGBA clearRGBA(clearColor);
+
+    #pragma omp parallel for schedule(dynamic) if(list.size() > 4)
+    for (int i = 0; i < (int)list.size(); ++i) {
+        int x0 = (list[i] % tilesX) * TILE_SIZE;
+        int y0 = (list[i] / tilesX) * TILE_SIZE;
+        int w = std::min(width - x0, (int)TILE_SIZE);
+        int h = std::min(height - y0, (int)TILE_SIZE);
+
+        // RGBA rows are filled with the clear word. In RGB gray (black included) is the same byte
+        // everywhere: memset, and any other color copies a prebuilt row
+        for (int y = y0; y < y0 + h; ++y) {
+            if (rgba) {
+                ColorRGBA* row = color.pixelsRGBA + y * width + x0;
+                std::fill(row, row + w, clearRGBA);
+                continue;
+            }
+            Color* row = color.pixels + y * width + x0;
+            if (gray)
+                memset((unsigned char*)row, clearColor.r, w * sizeof(Color));
+            else
+                memcpy(row, clearRow.data(), w * sizeof(Color));
+        }
+        depth.ClearRect(x0, y0, w, h, clearDepth);
+    }
+}
+
+void RenderTarget::Touch(int x0, int y0, int x1, int y1)
+{
+    x0 = std::max(x0, 0) / TILE_SIZE;
+    y0 = std::max(y0, 0) / TILE_SIZE;
+    x1 = std::min(x1 / TILE_SIZE, tilesX - 1);
+    y1 = std::min(y1 / TILE_SIZE, tilesY - 1);
+
+    std::vector<int> pending;
+    for (int ty = y0; ty <= y1; ++ty) {
+        for (int tx = x0; tx <= x1; ++tx) {
+            unsigned char& tile = tiles[ty * tilesX + tx];
+            if (tile == TILE_PENDING)
+                pending.push_back(ty * tilesX + tx);
+            tile = TILE_DRAWN;
+        }
+    }
+    ClearTiles(pending);
+}
+
+void RenderTarget::Invalidate(const std::vector<unsigned char>& mask)
+{
+    if (mask.size() != tiles.size()) return;
+
+    std::vector<int> list;
+    for (int t = 0; t < (int)tiles.size(); ++t) {
+        if (mask[t]) {
+            list.push_back(t);
+            tiles[t] = TILE_DRAWN;
+        }
+    }
+    ClearTiles(list);
+}
+
+void RenderTarget::Resolve()
+{
+    std::vector<int> pending;
+    for (int t = 0; t < (int)tiles.size(); ++t) {
+        if (tiles[t] == TILE_PENDING) {
+            pending.push_back(t);
+            tiles[t] = TILE_CLEAN;
+        }
+    }
+    ClearTiles(pending);
+}
+
+void GBuffer::Resize(unsigned int width, unsigned int height)
+{
+    if (this->width == width && this->height == height)
+        return;
+
+    this->width = width;
+    this->height = height;
+    depth.Resize(width, height);
+    normals.resize(width * height);
+    albedo.resize(width * height);
+    specular.resize(width * height);
+    uvs.resize(width * height);
+}
+
+void GBuffer::Clear()
+{
+    // Only the depth needs clearing, the other attributes are read where something was drawn
+    depth.Fill(1.0f);
+}
+
+void GBuffer::DrawTriangle(const sTriangleInfo& triangle, const Vector3* worldNormals, const sSurfaceInfo& surface)
+{
+    const Image* texture = surface.texture;
+    const Image* specularMap = surface.specularMap;
+    const Image* normalMap = surface.normalMap;
+
+    ForEachFragment(triangle.p0, triangle.p1, triangle.p2, width, 0, height - 1, [&](int x, int y, float u, float v, float w, float z) {
+        unsigned int pos = y * width + x;
+        if (z < -1.0f || z >= depth.pixels[pos]) return;
+
+        Vector2 uv(triangle.uv0.x * u + triangle.uv1.x * v + triangle.uv2.x * w,
+                   triangle.uv0.y * u + triangle.uv1.y * v + triangle.uv2.y * w);
+
+        Vector3 normal;
+        if (normalMap) {
+            Color n = SampleNearest(normalMap, uv);
+            normal = RotateByMatrix(surface.model, Vector3(n.r / 127.5f - 1.0f, n.g / 127.5f - 1.0f, n.b / 127.5f - 1.0f));
+        }
+        else {
+            normal = worldNormals[0] * u + worldNormals[1] * v + worldNormals[2] * w;
+        }
+
+        depth.pixels[pos] = z;
+        normals[pos] = PackNormal(normal);
+        albedo[pos] = texture ? SampleNearest(texture, uv) : Color(255, 255, 255);
+        specular[pos] = specularMap ? SampleNearest(specularMap, uv).r : 0;
+        uvs[pos] = uv;
+    });
+}
+
+template <typename T>
+static void ResolveGBuffer(const GBuffer& gbuffer, T* framebuffer, const sLighting& lighting, Camera* camera)
+{
+    unsigned int width = gbuffer.width;
+    unsigned int height = gbuffer.height;
+    if (framebuffer->width != width || framebuffer->height != height) return;
+
+    // Screen back to world space for the light vectors
+    Matrix44 inverseViewProjection = camera->viewprojection_matrix;
+    inverseViewProjection.Inverse();
+    float invWidth = 2.0f / width;
+    float invHeight = 2.0f / height;
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int y = 0; y < (int)height; ++y) {
+        sShadeSpan span;
+
+        for (int x = 0; x < (int)width; ++x) {
+            unsigned int pos = y * width + x;
+            float z = gbuffer.depth.pixels[pos];
+            if (z >= 1.0f) continue;
+
+            Vector4 clip = inverseViewProjection * Vector4(x * invWidth - 1.0f, 1.0f - y * invHeight, z, 1.0f);
+            Vector3 position(clip.x / clip.w, clip.y / clip.w, clip.z / clip.w);
+
+            span.Add(pos, position, UnpackNormal(gbuffer.normals[pos]), gbuffer.albedo[pos], gbuffer.specular[pos] / 255.0f);
+            if (span.count == SHADE_SPAN)
+                FlushSpan(lighting, span, framebuffer->pixels);
+        }
+
+        FlushSpan(lighting, span, framebuffer->pixels);
+    }
+}
+
+void GBuffer::Resolve(Image* framebuffer, const sLighting& lighting, Camera* camera)
+{
+    if (framebuffer->format == Image::FORMAT_RGBA) {
+        sPixelTarget<ColorRGBA> target = GetPixelTarget(framebuffer, framebuffer->pixelsRGBA);
+        ResolveGBuffer(*this, &target, lighting, camera);
+    }
+    else {
+        sPixelTarget<Color> target = GetPixelTarget(framebuffer, framebuffer->pixels);
+        ResolveGBuffer(*this, &target, lighting, camera);
+    }
+}
+
+void GBuffer::Resolve(HDRImage* framebuffer, const sLighting& lighting, Camera* camera)
+{
+    ResolveGBuffer(*this, framebuffer, lighting, camera);
+}
@@ -8,6 +8,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <iostream>
+#include <algorithm>
 #include "framework.h"
 
 //remove unsafe warnings
@@ -17,9 +18,11 @@
 #endif
 
 class FloatImage;
+class DepthBuffer;
 class Entity;
 class Camera;
 class Image;
+struct sLighting;
 
 // Structure for triangle rasterization
 // Estructura para almacenar la información de un triángulo
@@ -28,6 +31,17 @@ struct sTriangleInfo {
     Vector2 uv0, uv1, uv2; // Coordenadas UV
     Color c0, c1, c2; // Colores de los vértices
     Image* texture; // Textura asociada
+
+    // Only read when the triangle is drawn with lighting
+    Vector3 world0, world1, world2;     // World positions
+    Vector3 n0, n1, n2;                 // World normals
+    Image* normalMap = nullptr;         // Object space normals, replace n0..n2 if set
+    Image* specularMap = nullptr;       // Specular intensity as gray
+    const float* model = nullptr;       // Model matrix, to bring the normal map to world space
+};
+// A line from (x0,y0) to (x1,y1) in pixels, used to draw batches of lines
+struct sLineSegment {
+    int x0, y0, x1, y1;
 };
 struct Cell {
     int minx = INT_MAX;
@@ -50,26 +64,44 @@ class Image
 public:
     unsigned int width;
     unsigned int height;
-    unsigned int bytes_per_pixel = 3; // Bits per pixel
+    unsigned int bytes_per_pixel = 3; // Bytes per pixel, 3 or 4 as the format
+
+    // Pixel formats. RGB packs 3 bytes per pixel in pixels. RGBA keeps each pixel in an aligned 32 bit
+    // word in pixelsRGBA: fills, lines and the triangle rasterizers store whole words and the alpha
+    // channel is kept. Render uploads GL_RGB or GL_RGBA and SaveTGA writes 24 or 32 bit files to match.
+    // Files are loaded as RGB; the framebuffer is usually RGBA
+    enum { FORMAT_RGB, FORMAT_RGBA };
+    int format = FORMAT_RGB;
+
+    // Depth test of DrawTriangleInterpolated. With DEPTH_LESS fragments nearer than the z-buffer pass and
+    // write their depth. After a depth prepass use DEPTH_EQUAL: only the fragment that set the stored depth
+    // is shaded and the z-buffer is left as it is
+    enum { DEPTH_LESS, DEPTH_EQUAL };
+    int depthFunc = DEPTH_LESS;
     
     //From Lab1:
     void DrawLineDDA(int x0, int y0, int x1, int y1, const Color& color);
+    void DrawLine(int x0, int y0, int x1, int y1, const Color& color); // Integer Bresenham on the clipped line
+    void DrawLineAA(float x0, float y0, float x1, float y1, const Color& color); // Xiaolin Wu anti-aliased line
+    void DrawLines(const std::vector<sLineSegment>& lines, const Color& color, bool antialiased = false);
     void ScanLineDDA(int x0, int y0, int x1, int y1, std::vector<std::pair<int, int>>& table, int minY);
     void DrawTriangle(const Vector2& p0, const Vector2& p1, const Vector2& p2, const Color& borderColor, bool isFilled, const Color& fillColor);
     //void DrawTriangleInterpolated(const Vector3& p0, const Vector3& p1, const Vector3& p2, const Color& c0, const Color& c1, const Color& c2);
     //void DrawTriangleInterpolated(const Vector3& p0, const Vector3& p1, const Vector3& p2, const Color& c0, const Color& c1, const Color& c2, FloatImage* zBuffer);
     //void DrawTriangleInterpolated(const Vector3& p0, const Vector3& p1, const Vector3& p2, const Color& c0, const Color& c1, const Color& c2, FloatImage* zBuffer, Image* texture, const Vector2& uv0, const Vector2& uv1, const Vector2& uv2);
-    void DrawTriangleInterpolated(const sTriangleInfo& triangle, FloatImage* zBuffer, bool occlusions);
+    void DrawTriangleInterpolated(const sTriangleInfo& triangle, DepthBuffer* zBuffer, bool occlusions, const sLighting* lighting = nullptr);
+    void DrawTrianglesInterpolated(const std::vector<sTriangleInfo>& triangles, DepthBuffer* zBuffer, bool occlusions, const sLighting* lighting = nullptr);
 
  
 
     
     
-    Color* pixels;
+    Color* pixels;                 // FORMAT_RGB pixels, NULL in FORMAT_RGBA
+    ColorRGBA* pixelsRGBA = NULL;  // FORMAT_RGBA pixels, NULL in FORMAT_RGB
 
     // Constructors
     Image();
-    Image(unsigned int width, unsigned int height);
+    Image(unsigned int width, unsigned int height, int format = FORMAT_RGB);
     Image(const Image& c);
     Image& operator = (const Image& c); // Assign operator
 
@@ -78,33 +110,42 @@ public:
 
     void Render();
 
+    // Converts the pixels to another format, RGB to RGBA sets every alpha to the given one
+    void SetFormat(int format, unsigned char alpha = 255);
+
+    // The pixels of either format as bytes, bytes_per_pixel per pixel
+    unsigned char* GetBytes() const { return format == FORMAT_RGBA ? (unsigned char*)pixelsRGBA : (unsigned char*)pixels; }
+
     // Get the pixel at position x,y
-    Color GetPixel(unsigned int x, unsigned int y) const { return pixels[ y * width + x ]; }
-    Color& GetPixelRef(unsigned int x, unsigned int y)    { return pixels[ y * width + x ]; }
+    Color GetPixel(unsigned int x, unsigned int y) const { return format == FORMAT_RGBA ? pixelsRGBA[ y * width + x ].ToColor() : pixels[ y * width + x ]; }
+    Color& GetPixelRef(unsigned int x, unsigned int y)    { return pixels[ y * width + x ]; } // FORMAT_RGB only
     Color GetPixelSafe(unsigned int x, unsigned int y) const {
         x = clamp((unsigned int)x, 0, width-1);
         y = clamp((unsigned int)y, 0, height-1);
-        return pixels[ y * width + x ];
+        return GetPixel(x, y);
     }
 
-    // Set the pixel at position x,y with value C
-    void SetPixel(unsigned int x, unsigned int y, const Color& c) { if(x < 0 || x > width-1) return; if(y < 0 || y > height-1) return; pixels[ y * width + x ] = c; }
-    inline void SetPixelUnsafe(unsigned int x, unsigned int y, const Color& c) { pixels[ y * width + x ] = c; }
+    // Set the pixel at position x,y with value C (the alpha of RGBA pixels is set to 255)
+    void SetPixel(unsigned int x, unsigned int y, const Color& c) { if(x < 0 || x > width-1) return; if(y < 0 || y > height-1) return; SetPixelUnsafe(x, y, c); }
+    inline void SetPixelUnsafe(unsigned int x, unsigned int y, const Color& c) {
+        if (format == FORMAT_RGBA) pixelsRGBA[ y * width + x ] = ColorRGBA(c);
+        else pixels[ y * width + x ] = c;
+    }
 
     void Resize(unsigned int width, unsigned int height);
     void Scale(unsigned int width, unsigned int height);
     
     void FlipY(); // Flip the image top-down
 
-    // Fill the image with the color C
-    void Fill(const Color& c) { for(unsigned int pos = 0; pos < width*height; ++pos) pixels[pos] = c; }
+    // Fill the image with the color C, one 32 bit store per pixel in RGBA
+    void Fill(const Color& c);
 
     // Returns a new image with the area from (startx,starty) of size width,height
     Image GetArea(unsigned int start_x, unsigned int start_y, unsigned int width, unsigned int height);
 
     // Save or load images from the hard drive
     bool LoadPNG(const char* filename, bool flip_y = true);
-    bool LoadTGA(const char* filename, bool flip_y = false);
+    bool LoadTGA(const char* filename, bool flip_y = false, Image* alpha = nullptr); // alpha gets the 4th channel of 32 bit files as gray
     bool SaveTGA(const char* filename);
 
     void DrawRect(int x, int y, int w, int h, const Color& c);
@@ -118,14 +159,69 @@ public:
     template <typename F>
     Image& ForEachPixel( F callback )
     {
-        for(unsigned int pos = 0; pos < width*height; ++pos)
-            pixels[pos] = callback(pixels[pos]);
+        for(unsigned int pos = 0; pos < width*height; ++pos) {
+            if (format == FORMAT_RGBA)
+                pixelsRGBA[pos] = ColorRGBA(callback(pixelsRGBA[pos].ToColor()), pixelsRGBA[pos].a);
+            else
+                pixels[pos] = callback(pixels[pos]);
+        }
         return *this;
     }
     #endif
 };
 
 
+// Float color of HDRImage. 1 is the full intensity of an 8 bit Color, brighter values are kept. The textures
+// are sRGB and are lit as they are, so the values are display-referred, not linear
+struct sColorHDR {
+    float r, g, b, a;
+};
+
+// Floating point color target. Lights and samples are added without the 8 bit truncation of Color
+// and the result goes to an Image through a tone mapping and gamma pass
+class HDRImage
+{
+public:
+    enum { TONEMAP_CLAMP, TONEMAP_REINHARD, TONEMAP_ACES, TONEMAP_COUNT };
+
+    unsigned int width;
+    unsigned int height;
+    int depthFunc = Image::DEPTH_LESS; // See Image::depthFunc
+
+    sColorHDR* pixels;
+
+    // Constructors
+    HDRImage() { width = height = 0; pixels = NULL; }
+    HDRImage(unsigned int width, unsigned int height);
+    HDRImage(const HDRImage& c);
+    HDRImage& operator = (const HDRImage& c); // Assign operator
+
+    // Destructor
+    ~HDRImage();
+
+    sColorHDR GetPixel(unsigned int x, unsigned int y) const { return pixels[y * width + x]; }
+    sColorHDR& GetPixelRef(unsigned int x, unsigned int y) { return pixels[y * width + x]; }
+    inline void SetPixelUnsafe(unsigned int x, unsigned int y, const sColorHDR& c) { pixels[y * width + x] = c; }
+
+    void Resize(unsigned int width, unsigned int height); // The content is lost
+    void Fill(const sColorHDR& c);
+
+    // this += src * weight, e.g. one light or one sample at a time
+    void Accumulate(const HDRImage& src, float weight = 1.0f);
+
+    // Same rasterizer as Image, the lit fragments are not clamped
+    void DrawTriangleInterpolated(const sTriangleInfo& triangle, DepthBuffer* zBuffer, bool occlusions, const sLighting* lighting = nullptr);
+    void DrawTrianglesInterpolated(const std::vector<sTriangleInfo>& triangles, DepthBuffer* zBuffer, bool occlusions, const sLighting* lighting = nullptr);
+
+    // Exposure, tone mapping and gamma into an 8 bit target of the same size, rows in parallel. Gamma 1 for
+    // display-referred pixels; 2.2 only for pixels lit from linearized colors, or the gamma is applied twice
+    void Resolve(Image* target, int toneMap = TONEMAP_ACES, float exposure = 1.0f, float gamma = 1.0f) const;
+
+    static const char* GetToneMapName(int toneMap);
+};
+
+
+
 // Image storing one float per pixel instead of a 3 or 4 component Color
 
 class FloatImage
@@ -160,4 +256,224 @@ public:
     inline void SetPixelUnsafe(unsigned int x, unsigned int y, const float& v) { pixels[y * width + x] = v; }
 
     void Resize(unsigned int width, unsigned int height);
+
+    // Depth-only fast path: nearest depth of a screen space triangle soup, no color or attributes.
+    // The image is split in bands of rows that are rasterized in parallel
+    void RasterizeDepth(const std::vector<Vector3>& screenVertices);
+};
+
+// Multi-sample color and depth for interpolated triangles. Each pixel keeps 2, 4 or 8 samples but is
+// shaded once, and the color goes to the samples the triangle covers. Resolve copies the pixels whose
+// samples are all equal and averages only the edge ones, so the extra work is paid at the edges
+class MSAABuffer
+{
+public:
+    unsigned int width = 0;
+    unsigned int height = 0;
+    int samples = 4;
+
+    FloatImage depth;                    // width * samples columns, the samples of a pixel side by side
+    std::vector<ColorRGBA> color;        // Same layout as depth
+    std::vector<unsigned char> coverage; // Bit s set when sample s was drawn since the last Clear
+    std::vector<unsigned char> mixed;    // 0 when the drawn samples all hold the same color
+
+    // samples is rounded to 2, 4 or 8. The contents are lost when anything changes
+    void Resize(unsigned int width, unsigned int height, int samples);
+
+    // Resets the coverage and sets every sample to the depth of its pixel in seed (same size), or to 1
+    // without it. The samples behind what seed holds are rejected, the resolve shows that instead
+    void Clear(const DepthBuffer* seed = nullptr);
+
+    void DrawTriangleInterpolated(const sTriangleInfo& triangle, bool occlusions, const sLighting* lighting = nullptr);
+    void DrawTrianglesInterpolated(const std::vector<sTriangleInfo>& triangles, bool occlusions, const sLighting* lighting = nullptr);
+
+    // Writes the pixels with drawn samples to target (same size), the samples not drawn take the
+    // color already in target so the edges blend with what is behind. Rows in parallel
+    void Resolve(Image* target) const;
+};
+
+// Depth formats of DepthBuffer: how a depth in [-1,1] is stored. The fixed point ones keep it as an
+// unsigned integer, so the depth test is an integer compare and DEPTH16 moves half the bytes of a float.
+// Equal is the test of DEPTH_EQUAL: the same depth give or take a rounding, about 1e-6 in NDC
+struct sDepth16 {
+    typedef unsigned short Type;
+    static Type Encode(float z) { return (Type)(std::min(std::max(z * 0.5f + 0.5f, 0.0f), 1.0f) * 65535.0f + 0.5f); }
+    static float Decode(Type d) { return d * (2.0f / 65535.0f) - 1.0f; }
+    static bool Equal(Type a, Type b) { return (a > b ? a - b : b - a) <= 1; }
+};
+
+struct sDepth24 {
+    typedef unsigned int Type; // 24 bits used, the top byte is zero
+    static Type Encode(float z) { return (Type)(std::min(std::max(z * 0.5f + 0.5f, 0.0f), 1.0f) * 16777215.0f + 0.5f); }
+    static float Decode(Type d) { return d * (2.0f / 16777215.0f) - 1.0f; }
+    static bool Equal(Type a, Type b) { return (a > b ? a - b : b - a) <= 8; }
+};
+
+struct sDepth32F {
+    typedef float Type;
+    static Type Encode(float z) { return z; }
+    static float Decode(Type d) { return d; }
+    static bool Equal(Type a, Type b) { return fabsf(a - b) <= 1e-6f; }
+};
+
+// Z-buffer with a selectable storage format. Pixels are packed rows of the format word; the
+// rasterizers are templates on the format (sDepth16, sDepth24, sDepth32F) and get the words with Data<F>()
+class DepthBuffer
+{
+public:
+    enum { DEPTH16, DEPTH24, DEPTH32F };
+
+    unsigned int width = 0;
+    unsigned int height = 0;
+    int format = DEPTH16;
+
+    DepthBuffer() {}
+    DepthBuffer(unsigned int width, unsigned int height, int format = DEPTH16);
+    DepthBuffer(const DepthBuffer& c) = delete;
+    DepthBuffer& operator = (const DepthBuffer& c) = delete;
+    ~DepthBuffer();
+
+    void Resize(unsigned int width, unsigned int height);
+    void SetFormat(int format); // The contents are lost, the buffer is cleared to 1
+    unsigned int BytesPerPixel() const;
+    const char* GetFormatName() const;
+
+    // Sets every pixel to depth z (1 = farthest) with a single fill of the encoded word
+    void Clear(float z = 1.0f);
+    void ClearRect(unsigned int x, unsigned int y, unsigned int w, unsigned int h, float z = 1.0f);
+
+    float GetDepth(unsigned int x, unsigned int y) const;
+
+    template <typename F> typename F::Type* Data() { return reinterpret_cast<typename F::Type*>(data); }
+    template <typename F> const typename F::Type* Data() const { return reinterpret_cast<const typename F::Type*>(data); }
+
+    // Same as FloatImage::RasterizeDepth, in the format of the buffer
+    void RasterizeDepth(const std::vector<Vector3>& screenVertices);
+
+private:
+    unsigned char* data = nullptr;
+};
+
+// Color and depth of a frame, cleared together and lazily. Clear only records the clear values; the
+// screen is split in tiles and a tile is cleared when something is about to be drawn on it (Touch) or,
+// if nothing was, at Resolve. Tiles that were not drawn since their last clear already hold the clear
+// values and are not written at all
+class RenderTarget
+{
+public:
+    static const int TILE_SIZE = 64;
+
+    Image color;
+    DepthBuffer depth;
+
+    void Resize(unsigned int width, unsigned int height);
+
+    void Clear(const Color& c, float z = 1.0f);
+
+    // Changes the format of depth or of color. Every tile is cleared again on its next use
+    void SetDepthFormat(int format);
+    void SetColorFormat(int format);
+
+    // Clears the pending tiles that overlap the pixels [x0,x1] x [y0,y1]. Call it before drawing there
+    void Touch(int x0, int y0, int x1, int y1);
+    void TouchAll() { Touch(0, 0, (int)color.width - 1, (int)color.height - 1); }
+
+    // Clears the tiles still holding an older frame, after this the target is ready to display
+    void Resolve();
+
+    // Clears now the tiles set in mask (tilesX * tilesY bytes, row by row), whatever they hold, to draw them again
+    void Invalidate(const std::vector<unsigned char>& mask);
+    int GetTilesX() const { return tilesX; }
+    int GetTilesY() const { return tilesY; }
+
+private:
+    enum { TILE_CLEAN, TILE_PENDING, TILE_DRAWN };
+
+    int tilesX = 0;
+    int tilesY = 0;
+    std::vector<unsigned char> tiles;
+    Color clearColor;
+    float clearDepth = 1.0f;
+    std::vector<Color> clearRow; // TILE_SIZE pixels of the clear color, copied to each row of a tile (RGB)
+
+    void ClearTiles(const std::vector<int>& list);
+};
+
+// A light used by the lighting passes
+struct sLight {
+    enum { POINT, DIRECTIONAL, SPOT };
+    int type = POINT;
+
+    Vector3 position;
+    Vector3 direction = Vector3(0, 0, -1); // Where directional and spot lights point to
+    Vector3 color = Vector3(1, 1, 1);      // Intensity per channel, 1 = full
+    float radius = 10.0f;                  // The light fades out to zero at this distance (not directional)
+    float spotAngle = 30.0f;               // Half angle of the spot cone in degrees
+
+    bool castShadows = false;              // Directional and spot lights only
+    bool isStatic = true;                  // Its shadow map can be kept while the scene does not move
+};
+
+// Depth of the scene seen from a light, rendered with the depth-only rasterizer
+struct sShadowMap {
+    FloatImage depth;
+    Matrix44 viewprojection;
+    float bias = 0.002f;
+    bool valid = false;                    // False when it has to be rendered again
+
+    // 1 if the world position is lit, 0 if something is closer to the light
+    float Visibility(const Vector3& position) const;
+};
+
+// The lights of a frame laid out as arrays per attribute (SoA), the way the shading kernel reads them
+struct sLighting {
+    std::vector<int> type;
+    std::vector<float> positionX, positionY, positionZ;
+    std::vector<float> directionX, directionY, directionZ;
+    std::vector<float> colorR, colorG, colorB;
+    std::vector<float> invRadius;
+    std::vector<float> cosOuter, invConeWidth;      // Spot cone, every point passes for other lights
+    std::vector<const sShadowMap*> shadowMaps;      // nullptr for lights without shadows
+
+    Vector3 eye;                                 // Camera position for the specular term
+    Vector3 ambient = Vector3(0.1f, 0.1f, 0.1f);
+    float shininess = 32.0f;
+
+    // shadowMaps, when given, has one entry per light
+    void SetLights(const std::vector<sLight>& lights, const std::vector<sShadowMap>* shadowMaps = nullptr);
+    int NumLights() const { return (int)positionX.size(); }
+};
+
+// Textures and transform of the entity a triangle belongs to, for the deferred geometry pass
+struct sSurfaceInfo {
+    const Image* texture = nullptr;     // Albedo, white if missing
+    const Image* specularMap = nullptr; // Specular intensity as gray, none if missing
+    const Image* normalMap = nullptr;   // Object space normals, the vertex normals are used if missing
+    const float* model = nullptr;       // Model matrix, to bring the normals to world space
+};
+
+// Screen sized surface attributes of the closest fragments. The geometry pass only fills it,
+// the lighting pass then shades every covered pixel once whatever the overdraw was
+class GBuffer
+{
+public:
+    unsigned int width = 0;
+    unsigned int height = 0;
+
+    FloatImage depth;                  // NDC depth, 1 where nothing was drawn
+    std::vector<unsigned int> normals; // World normals, octahedral encoding in 2x16 bits
+    std::vector<Color> albedo;
+    std::vector<unsigned char> specular;
+    std::vector<Vector2> uvs;
+
+    void Resize(unsigned int width, unsigned int height);
+    void Clear();
+
+    // Geometry pass, the triangle is in screen space and the normals in world space
+    void DrawTriangle(const sTriangleInfo& triangle, const Vector3* worldNormals, const sSurfaceInfo& surface);
+
+    // Lighting pass, Blinn-Phong for all the lights on each covered pixel (rows in parallel).
+    // Into an HDRImage the light sums are kept above white for the tone mapping
+    void Resolve(Image* framebuffer, const sLighting& lighting, Camera* camera);
+    void Resolve(HDRImage* framebuffer, const sLighting& lighting, Camera* camera);
 };
@@ -5,6 +5,10 @@
 #include <string>
 #include <sys/stat.h>
 #include <cstring>
+#include <map>
+#include <tuple>
+#include <algorithm>
+#include <unordered_set>
 
 Mesh::Mesh()
 {
@@ -15,6 +19,9 @@ void Mesh::Clear()
 	vertices.clear();
 	normals.clear();
 	uvs.clear();
+	points.clear();
+	edgesDirty = true;
+	boundsDirty = true;
 }
 
 void Mesh::Render(int primitive)
@@ -46,11 +53,70 @@ void Mesh::Render(int primitive)
 		glDisableClientState(GL_TEXTURE_COORD_ARRAY);
 }
 
+void Mesh::BuildBounds()
+{
+	const std::vector<Vector3>& positions = vertices.empty() ? points : vertices;
+	boundsDirty = false;
+
+	if (positions.empty()) {
+		boundsMin = boundsMax = Vector3(0, 0, 0);
+		return;
+	}
+
+	boundsMin = boundsMax = positions[0];
+	for (const Vector3& p : positions) {
+		boundsMin.x = std::min(boundsMin.x, p.x); boundsMax.x = std::max(boundsMax.x, p.x);
+		boundsMin.y = std::min(boundsMin.y, p.y); boundsMax.y = std::max(boundsMax.y, p.y);
+		boundsMin.z = std::min(boundsMin.z, p.z); boundsMax.z = std::max(boundsMax.z, p.z);
+	}
+}
+
+void Mesh::BuildEdges()
+{
+	wireVertices.clear();
+	edges.clear();
+	points.clear();
+	edgesDirty = false;
+
+	// Weld the soup vertices that share the same position
+	std::map<std::tuple<float, float, float>, int> welded;
+	std::vector<int> remap(vertices.size());
+	for (size_t i = 0; i < vertices.size(); ++i)
+	{
+		const Vector3& v = vertices[i];
+		auto it = welded.emplace(std::make_tuple(v.x, v.y, v.z), (int)wireVertices.size());
+		if (it.second)
+		{
+			wireVertices.push_back((int)i);
+			points.push_back(v);
+		}
+		remap[i] = it.first->second;
+	}
+
+	// Keep each undirected edge once
+	std::unordered_set<unsigned long long> seen;
+	seen.reserve(vertices.size());
+	for (size_t i = 0; i + 2 < vertices.size(); i += 3)
+	{
+		for (int j = 0; j < 3; ++j)
+		{
+			int a = remap[i + j];
+			int b = remap[i + (j + 1) % 3];
+			if (a == b) continue;
+			if (a > b) std::swap(a, b);
+			if (seen.insert(((unsigned long long)a << 32) | (unsigned int)b).second)
+				edges.push_back({ a, b });
+		}
+	}
+}
+
 void Mesh::CreateQuad()
 {
 	vertices.clear();
 	normals.clear();
 	uvs.clear();
+	edgesDirty = true;
+	boundsDirty = true;
 
 	// Create six vertices (3 for upperleft triangle and 3 for lowerright)
 	vertices.push_back(Vector3(1, 1, 0));
@@ -74,6 +140,8 @@ void Mesh::CreatePlane(float size)
 	vertices.clear();
 	normals.clear();
 	uvs.clear();
+	edgesDirty = true;
+	boundsDirty = true;
 
 	// Create six vertices (3 for upperleft triangle and 3 for lowerright)
 
@@ -106,6 +174,8 @@ void Mesh::CreateCube(float size)
 	vertices.clear();
 	normals.clear();
 	uvs.clear();
+	edgesDirty = true;
+	boundsDirty = true;
 
 	
 	vertices.push_back(Vector3(size,  size, size));
@@ -272,6 +342,8 @@ bool Mesh::LoadOBJ(const char* filename)
 	const float min_float = -10000000;
 
 	unsigned int vertex_i = 0;
+	edgesDirty = true;
+	boundsDirty = true;
 
 	//parse file
 	while (*pos != 0)
@@ -346,3 +418,186 @@ bool Mesh::LoadOBJ(const char* filename)
 
 	return true;
 }
+
+// Size in bytes of a PLY property type, 0 if unknown
+static int plyTypeSize(const std::string& type)
+{
+	if (type == "char" || type == "uchar" || type == "int8" || type == "uint8") return 1;
+	if (type == "short" || type == "ushort" || type == "int16" || type == "uint16") return 2;
+	if (type == "int" || type == "uint" || type == "int32" || type == "uint32" || type == "float" || type == "float32") return 4;
+	if (type == "double" || type == "float64") return 8;
+	return 0;
+}
+
+bool Mesh::LoadPoints(const char* filename)
+{
+	struct stat stbuffer;
+	std::cout << "Loading points: " << filename << std::endl;
+
+	std::string relPath = absResPath(filename);
+
+	FILE* f = fopen(relPath.c_str(), "rb");
+	if (f == NULL)
+	{
+		std::cerr << "File not found: " << filename << std::endl;
+		return false;
+	}
+
+	stat(relPath.c_str(), &stbuffer);
+
+	size_t size = stbuffer.st_size;
+	char* data = new char[size + 1];
+	size = fread(data, 1, size, f);
+	fclose(f);
+	data[size] = 0;
+
+	Clear();
+
+	char* pos = data;
+	char* end = data + size;
+
+	if (strncmp(data, "ply", 3) != 0)
+	{
+		// XYZ: one point per line, extra columns (normals, colors) are ignored. Lines that do not start
+		// with three numbers (comments, column names) are skipped whole
+		while (pos < end)
+		{
+			char* lineEnd = pos;
+			while (lineEnd < end && *lineEnd != '\n') lineEnd++;
+			*lineEnd = 0; // data[size] is already 0
+
+			char* next;
+			float x = strtof(pos, &next);
+			bool numeric = next != pos;
+			float y = strtof(pos = next, &next);
+			numeric = numeric && next != pos;
+			float z = strtof(pos = next, &next);
+			numeric = numeric && next != pos;
+			if (numeric)
+				points.push_back(Vector3(x, y, z));
+
+			pos = lineEnd + 1;
+		}
+	}
+	else
+	{
+		// PLY header, only the vertex element (which must come first) is read
+		bool binary = false;
+		bool inVertex = false;
+		size_t numPoints = 0;
+		int stride = 0;
+		int offsets[3] = { -1, -1, -1 };
+		int sizes[3] = { 0, 0, 0 };
+		int column = 0;
+		int columns[3] = { -1, -1, -1 };
+		bool valid = true;
+		bool headerEnded = false;
+
+		while (pos < end)
+		{
+			char* lineEnd = pos;
+			while (lineEnd < end && *lineEnd != '\n') lineEnd++;
+			std::string line(pos, lineEnd);
+			pos = lineEnd < end ? lineEnd + 1 : end; // The last line may have no newline
+
+			std::vector<std::string> tokens = tokenize(line.c_str(), " \r");
+			if (tokens.empty()) continue;
+
+			if (tokens[0] == "end_header")
+			{
+				headerEnded = true;
+				break;
+			}
+			else if (tokens[0] == "format" && tokens.size() > 1)
+			{
+				binary = tokens[1] == "binary_little_endian";
+				if (!binary && tokens[1] != "ascii")
+					valid = false;
+			}
+			else if (tokens[0] == "element" && tokens.size() > 2)
+			{
+				inVertex = tokens[1] == "vertex";
+				if (inVertex)
+					numPoints = strtoul(tokens[2].c_str(), NULL, 10);
+				else if (numPoints == 0)
+					valid = false;
+			}
+			else if (tokens[0] == "property" && inVertex && tokens.size() > 2)
+			{
+				int typeSize = plyTypeSize(tokens[1]);
+				const std::string& name = tokens.back();
+				int axis = name == "x" ? 0 : name == "y" ? 1 : name == "z" ? 2 : -1;
+				if (axis >= 0)
+				{
+					offsets[axis] = stride;
+					sizes[axis] = typeSize;
+					columns[axis] = column;
+				}
+				if (typeSize == 0)
+					valid = false;
+				stride += typeSize;
+				column++;
+			}
+		}
+
+		if (!valid || !headerEnded || offsets[0] < 0 || offsets[1] < 0 || offsets[2] < 0 ||
+			(sizes[0] != 4 && sizes[0] != 8) || sizes[0] != sizes[1] || sizes[0] != sizes[2])
+		{
+			std::cerr << "Unsupported PLY file: " << filename << std::endl;
+			delete[] data;
+			return false;
+		}
+
+		points.resize(numPoints);
+
+		if (binary)
+		{
+			if ((size_t)(end - pos) < numPoints * stride)
+				numPoints = (end - pos) / stride;
+			points.resize(numPoints);
+
+			for (size_t i = 0; i < numPoints; ++i)
+			{
+				const char* vertex = pos + i * stride;
+				float xyz[3];
+				for (int axis = 0; axis < 3; ++axis)
+				{
+					if (sizes[axis] == 4)
+						memcpy(&xyz[axis], vertex + offsets[axis], 4);
+					else
+					{
+						double value;
+						memcpy(&value, vertex + offsets[axis], 8);
+						xyz[axis] = (float)value;
+					}
+				}
+				points[i] = Vector3(xyz[0], xyz[1], xyz[2]);
+			}
+		}
+		else
+		{
+			size_t i = 0;
+			while (i < numPoints && pos < end)
+			{
+				float xyz[3] = { 0, 0, 0 };
+				char* next = pos;
+				for (int c = 0; c < column; ++c)
+				{
+					float value = strtof(next, &next);
+					for (int axis = 0; axis < 3; ++axis)
+						if (columns[axis] == c) xyz[axis] = value;
+				}
+				points[i++] = Vector3(xyz[0], xyz[1], xyz[2]);
+
+				while (next < end && *next != '\n') next++;
+				pos = next < end ? next + 1 : end;
+			}
+			points.resize(i);
+		}
+	}
+
+	delete[] data;
+
+	std::cout << "Loaded " << points.size() << " points" << std::endl;
+	return !points.empty();
+}
@@ -9,12 +9,32 @@
 #include "camera.h"
 #include "main/includes.h"
 
+// Edge between two entries of the mesh wire vertices
+struct sEdge {
+	int a, b;
+};
+
 class Mesh
 {
 	std::vector<Vector3> vertices;
 	std::vector<Vector3> normals;
 	std::vector<Vector2> uvs;
 
+	// Unique edges of the triangle soup, built on demand and cached until the mesh changes
+	std::vector<int> wireVertices; // Index of the first soup vertex with each unique position
+	std::vector<sEdge> edges;
+	bool edgesDirty = true;
+
+	// Unique positions, either welded from the triangles or loaded as a raw point set
+	std::vector<Vector3> points;
+
+	// Axis aligned box of the vertices (or of the points of a point set), cached until the mesh changes
+	Vector3 boundsMin, boundsMax;
+	bool boundsDirty = true;
+
+	void BuildEdges();
+	void BuildBounds();
+
 public:
 
 	Mesh();
@@ -26,8 +46,19 @@ public:
 	void CreateQuad();
 
 	bool LoadOBJ(const char* filename);
+	bool LoadPoints(const char* filename); // Point set from a .ply (ascii or binary) or .xyz file
 
 	const std::vector<Vector3>& GetVertices() { return vertices; }
 	const std::vector<Vector3>& GetNormals() { return normals; }
 	const std::vector<Vector2>& GetUVs() { return uvs; }
+
+	// Each edge shared by several triangles appears only once. A point set has no edges and keeps its points
+	const std::vector<int>& GetWireVertices() { if (!vertices.empty() && edgesDirty) BuildEdges(); return wireVertices; }
+	const std::vector<sEdge>& GetEdges() { if (!vertices.empty() && edgesDirty) BuildEdges(); return edges; }
+	const std::vector<Vector3>& GetPoints() { if (!vertices.empty() && edgesDirty) BuildEdges(); return points; }
+
+	// Loaded with LoadPoints: only points, no triangles
+	bool IsPointSet() const { return vertices.empty() && !points.empty(); }
+
+	void GetBounds(Vector3& min, Vector3& max) { if (boundsDirty) BuildBounds(); min = boundsMin; max = boundsMax; }
 };
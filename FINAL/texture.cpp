@@ -98,7 +98,7 @@ bool Texture::Load(const char* filename, bool mipmaps)
 			return false;
 		}
 		this->filename = sfullPath;
-		Create(image->width, image->height, image->bytes_per_pixel == 3 ? GL_RGB : GL_RGBA, GL_UNSIGNED_BYTE, mipmaps, (Uint8*)image->pixels);
+		Create(image->width, image->height, image->bytes_per_pixel == 3 ? GL_RGB : GL_RGBA, GL_UNSIGNED_BYTE, mipmaps, image->GetBytes());
 		return true;
 	}
 	else {
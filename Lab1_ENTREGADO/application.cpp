@@ -19,6 +19,7 @@ Application::Application(const char* caption, int width, int height)
     this->keystate = SDL_GetKeyboardState(nullptr);
 
     this->framebuffer.Resize(w, h);
+    this->framebuffer.trackDamage = true;
     this->backupFramebuffer.Resize(w, h);
 
     
@@ -33,7 +34,8 @@ void Application::Init(void)
 {
     std::cout << "Initiating app..." << std::endl;
     InitButtons();
-    particleSystem.Init();
+    quad.CreateQuad();
+    particleSystem.Init(ParticleSystem::DEFAULT_PARTICLES, window_width, window_height);
 
 }
 
@@ -42,22 +44,6 @@ int Application::ComputeRadius(int x1, int y1, int x2, int y2) {
 }
 
 void Application::Render(void) {
-    // Define the dimensions of the gray rectangle
-    int toolbar_height = 50; // Height of the rectangle
-    int toolbar_width = window_width; // Full width of the window
-    int toolbar_x = 0; // Top-left corner x-coordinate
-    int toolbar_y = 0; // Top-left corner y-coordinate
-
-    // Draw the gray rectangle
-    if (buttonsstate) {
-        framebuffer.DrawRect(toolbar_x, toolbar_y, toolbar_width, toolbar_height,
-            Color(192, 192, 192), 0, true, Color(192, 192, 192)); // Filled gray rectangle
-        for (const Button& button : buttons) {
-            button.Render(framebuffer);
-        }
-    }
-
-
     if (particleSystemActive) {
         particleSystem.Render(&framebuffer);
     }
@@ -103,8 +89,47 @@ void Application::Render(void) {
         shouldRender = false;
     }
 
+    // Define the dimensions of the gray rectangle
+    int toolbar_height = 50; // Height of the rectangle
+    int toolbar_width = window_width; // Full width of the window
+    int toolbar_x = 0; // Top-left corner x-coordinate
+    int toolbar_y = 0; // Top-left corner y-coordinate
+
+    // Draw the gray rectangle, only if something has been drawn over it
+    if (buttonsstate && (toolbarDirty || framebuffer.IsDirty(toolbar_x, toolbar_y, toolbar_width, toolbar_height))) {
+        framebuffer.DrawRect(toolbar_x, toolbar_y, toolbar_width, toolbar_height,
+            Color(192, 192, 192), 0, true, Color(192, 192, 192)); // Filled gray rectangle
+        for (const Button& button : buttons) {
+            button.Render(framebuffer);
+        }
+        toolbarDirty = false;
+    }
+
     // Render the framebuffer to the screen
-    framebuffer.Render();
+    PresentFramebuffer();
+}
+
+// Uploads only the areas modified since the last frame and draws them with a full screen quad
+void Application::PresentFramebuffer(void) {
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+    if (framebufferTexture.width != framebuffer.width || framebufferTexture.height != framebuffer.height) {
+        framebufferTexture.Create(framebuffer.width, framebuffer.height, GL_RGB, GL_UNSIGNED_BYTE, false, (Uint8*)framebuffer.pixels);
+    }
+    else {
+        for (const Image::sRect& rect : framebuffer.dirtyRects)
+            framebufferTexture.UploadArea(rect.x, rect.y, rect.w, rect.h, framebuffer.width, (Uint8*)framebuffer.pixels);
+    }
+    framebuffer.ClearDirty();
+
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    glMatrixMode(GL_MODELVIEW);
+    glLoadIdentity();
+
+    framebufferTexture.Bind();
+    quad.Render();
+    framebufferTexture.Unbind();
 }
 
 
@@ -165,10 +190,16 @@ void Application::OnKeyPressed(SDL_KeyboardEvent event)
             framebuffer.Fill(Color(0, 0, 0));
         }
         particleSystemActive = !particleSystemActive;
+        particleSystem.tileTouched.clear(); // The first frame clears every tile
         std::cout << "Particle system " << (particleSystemActive ? "activated" : "deactivated") << std::endl;
         break;
 
 
+    case SDLK_b:
+        particleSystem.blendMode = (particleSystem.blendMode + 1) % 3;
+        std::cout << "Particle blend mode " << particleSystem.blendMode << std::endl;
+        break;
+
     case SDLK_f:
         if (isFilled == true) {
             isFilled = false;
@@ -219,7 +250,7 @@ void Application::OnMouseButtonDown(SDL_MouseButtonEvent event) {
         Vector2 mousePosition(mouse_position.x, mouse_position.y);
         std::cout << "Mouse clicked at (" << mousePosition.x << ", " << mousePosition.y << ")" << std::endl;
 
-        backupFramebuffer = Image(framebuffer); // Save current state
+        backupFramebuffer = framebuffer; // Save current state (reuses the buffer when the size matches)
         startX = mouse_position.x;  // Save starting position
         startY = mouse_position.y;
 
@@ -372,7 +403,7 @@ void Application::OnMouseMove(SDL_MouseButtonEvent event) {
         framebuffer.DrawCircle(x, y, borderWidth+3, selected_color, 1, true, selected_color);
     }
     if (mouse_state & SDL_BUTTON(SDL_BUTTON_LEFT)&& exercise!=33) {
-        framebuffer = Image(backupFramebuffer); // Restore state
+        framebuffer = backupFramebuffer; // Restore state
         switch (exercise) {
         case 1: { // Line tool
             framebuffer.DrawLineDDA(startX, startY, mouse_position.x, mouse_position.y, selected_color);
@@ -441,96 +472,237 @@ void Application::InitButtons() {
         "images/cyan.png"
     };
 
+    toolbarDirty = true;
+
     int current_x = start_x;
+    buttons.reserve(numButtons);
     for (int i = 0; i < numButtons; ++i) {
-        Image* buttonImage = new Image();
-        if (!buttonImage->LoadPNG(imagePaths[i])) {
+        Image buttonImage;
+        if (!buttonImage.LoadPNG(imagePaths[i])) {
             std::cout << "Image not found: " << imagePaths[i] << std::endl;
-            delete buttonImage;
             continue;
         }
 
         // Define position and size for the button
         Vector2 buttonPosition(current_x, start_y);
-        Vector2 buttonSize(buttonImage->width, buttonImage->height);
-
-        // Create a button and add it to the buttons list
-        buttons.emplace_back(*buttonImage, buttonPosition, buttonSize);
+        Vector2 buttonSize(buttonImage.width, buttonImage.height);
 
         // Advance the x-coordinate for the next button
-        current_x += buttonImage->width + button_spacing;
+        current_x += buttonImage.width + button_spacing;
 
-        // Clean up dynamically allocated image (it gets copied into the Button)
-        delete buttonImage;
+        // Create a button and add it to the buttons list, the image is moved into it
+        buttons.emplace_back(std::move(buttonImage), buttonPosition, buttonSize);
     }
 }
 
-void ParticleSystem::Init() {
-    for (int i = 0; i < MAX_PARTICLES; ++i) {
-        particles[i].inactive = true; // Start as inactive
-    }
+void ParticleSystem::Init(int capacity, int width, int height) {
+    this->capacity = capacity;
+    positionX.resize(capacity);
+    positionY.resize(capacity);
+    velocityX.resize(capacity);
+    velocityY.resize(capacity);
+    colors.resize(capacity);
+    ttl.resize(capacity);
+
+    numAlive = 0;
+    SetBounds(width, height);
+    Spawn(capacity);
 }
 
-void ParticleSystem::Update(float dt) {
-    const int screenWidth = 1280;  // Screen width
-    const int screenHeight = 720; // Screen height
-
-    for (int i = 0; i < MAX_PARTICLES; ++i) {
-        if (particles[i].inactive) {
-            // Respawn particle if inactive
-            particles[i].position = Vector2(rand() % screenWidth, rand() % screenHeight); // Random spawn
-            particles[i].velocity = Vector2((rand() % 200 - 100) / 100.0f, (rand() % 200 - 100) / 100.0f); // Random velocity
-            particles[i].color = Color(rand() % 256, rand() % 256, rand() % 256); // Random color
-            particles[i].ttl = 0.0f; // Reset lifetime
-            particles[i].inactive = false;
+void ParticleSystem::SetBounds(int width, int height) {
+    this->width = std::max(1, width);
+    this->height = std::max(1, height);
+}
+
+void ParticleSystem::Spawn(int count) {
+    count = std::min(count, capacity - numAlive);
+    if (count <= 0) return;
+
+    const int chunkSize = 4096; // Particles spawned with the same generator
+    int first = numAlive;
+    int numChunks = (count + chunkSize - 1) / chunkSize;
+    seed++;
+
+#pragma omp parallel for
+    for (int c = 0; c < numChunks; ++c) {
+        FastRandom random(seed * 2654435761u + c * 40503u);
+        int begin = first + c * chunkSize;
+        int end = std::min(begin + chunkSize, first + count);
+
+        for (int i = begin; i < end; ++i) {
+            positionX[i] = random.Range(0.0f, (float)width);  // Random spawn
+            positionY[i] = random.Range(0.0f, (float)height);
+            velocityX[i] = random.Range(-100.0f, 100.0f);     // Random velocity
+            velocityY[i] = random.Range(-100.0f, 100.0f);
+            unsigned int bits = random.Next();                // Random color
+            colors[i] = Color(bits & 255, (bits >> 8) & 255, (bits >> 16) & 255);
+            ttl[i] = 0.0f;                                    // Reset lifetime
         }
+    }
 
-        // Update active particles
-        if (!particles[i].inactive) {
-            particles[i].ttl += dt; // Increment lifetime
-            if (particles[i].ttl >= 120.0f) { // Reactivate after 120 second
-                particles[i].inactive = true;
-            }
+    numAlive += count;
+}
 
-            // Update position
-            particles[i].position.x += particles[i].velocity.x * dt * 100.0f;
-            particles[i].position.y += particles[i].velocity.y * dt * 100.0f;
+void ParticleSystem::Kill(int index) {
+    // Move the last alive particle into the hole so the alive range stays dense
+    int last = numAlive - 1;
+    positionX[index] = positionX[last];
+    positionY[index] = positionY[last];
+    velocityX[index] = velocityX[last];
+    velocityY[index] = velocityY[last];
+    colors[index] = colors[last];
+    ttl[index] = ttl[last];
+    numAlive--;
+}
 
-            // Wrap-around bounds
-            if (particles[i].position.x < 0) particles[i].position.x += screenWidth;
-            if (particles[i].position.x >= screenWidth) particles[i].position.x -= screenWidth;
-            if (particles[i].position.y < 0) particles[i].position.y += screenHeight;
-            if (particles[i].position.y >= screenHeight) particles[i].position.y -= screenHeight;
-        }
+void ParticleSystem::Update(float dt) {
+    float w = (float)width;
+    float h = (float)height;
+    float invW = 1.0f / w;
+    float invH = 1.0f / h;
+
+    float* px = positionX.data();
+    float* py = positionY.data();
+    const float* vx = velocityX.data();
+    const float* vy = velocityY.data();
+    float* life = ttl.data();
+    int n = numAlive;
+
+    // Update position and wrap around the bounds without branches
+#pragma omp parallel for simd
+    for (int i = 0; i < n; ++i) {
+        float x = px[i] + vx[i] * dt;
+        float y = py[i] + vy[i] * dt;
+        px[i] = x - w * floorf(x * invW);
+        py[i] = y - h * floorf(y * invH);
+        life[i] += dt; // Increment lifetime
     }
+
+    // Remove the particles that reached their lifetime
+    for (int i = 0; i < numAlive; ) {
+        if (ttl[i] >= lifetime)
+            Kill(i);
+        else
+            ++i;
+    }
+
+    // Respawn the removed particles
+    Spawn(capacity - numAlive);
+}
+
+void ParticleSystem::BinParticles(int numTilesX, int numTilesY) {
+    int numTiles = numTilesX * numTilesY;
+    int half = particleSize / 2;
+    tileStart.assign(numTiles + 1, 0);
+
+    // Visits every tile touched by the square of particle i
+    auto forEachTile = [&](int i, auto callback) {
+        int x = static_cast<int>(positionX[i]);
+        int y = static_cast<int>(positionY[i]);
+        int tx0 = std::max(x - half, 0) / TILE_SIZE;
+        int ty0 = std::max(y - half, 0) / TILE_SIZE;
+        int tx1 = std::min((x + half) / TILE_SIZE, numTilesX - 1);
+        int ty1 = std::min((y + half) / TILE_SIZE, numTilesY - 1);
+        for (int ty = ty0; ty <= ty1; ++ty)
+            for (int tx = tx0; tx <= tx1; ++tx)
+                callback(ty * numTilesX + tx);
+    };
+
+    // Counting sort: count, prefix sum and scatter (keeps the particle order inside each tile)
+    for (int i = 0; i < numAlive; ++i)
+        forEachTile(i, [&](int t) { tileStart[t + 1]++; });
+    for (int t = 0; t < numTiles; ++t)
+        tileStart[t + 1] += tileStart[t];
+
+    tileParticles.resize(tileStart[numTiles]);
+    std::vector<int> cursor(tileStart.begin(), tileStart.end() - 1);
+    for (int i = 0; i < numAlive; ++i)
+        forEachTile(i, [&](int t) { tileParticles[cursor[t]++] = i; });
 }
 
 void ParticleSystem::Render(Image* framebuffer) {
-    // Clear the framebuffer to black
-    framebuffer->Fill(Color(0, 0, 0));
-
-    const int particleSize = 5; // Size of the particle (width and height of the square)
-
-    // Render all active particles
-    for (int i = 0; i < MAX_PARTICLES; ++i) {
-        if (!particles[i].inactive) {
-            // Draw a square for each particle
-            int x = static_cast<int>(particles[i].position.x);
-            int y = static_cast<int>(particles[i].position.y);
-
-            // Draw a filled square (use a loop to simulate a larger particle)
-            for (int dx = -particleSize / 2; dx <= particleSize / 2; ++dx) {
-                for (int dy = -particleSize / 2; dy <= particleSize / 2; ++dy) {
-                    int drawX = x + dx;
-                    int drawY = y + dy;
-
-                    // Check bounds to avoid out-of-framebuffer access
-                    if (drawX >= 0 && drawX < framebuffer->width && drawY >= 0 && drawY < framebuffer->height) {
-                        framebuffer->SetPixel(drawX, drawY, particles[i].color);
+    int fbWidth = framebuffer->width;
+    int fbHeight = framebuffer->height;
+    int numTilesX = (fbWidth + TILE_SIZE - 1) / TILE_SIZE;
+    int numTilesY = (fbHeight + TILE_SIZE - 1) / TILE_SIZE;
+    if (numTilesX <= 0 || numTilesY <= 0) return;
+
+    BinParticles(numTilesX, numTilesY);
+
+    // After a resize (or when activated) every tile has to be cleared once
+    if ((int)tileTouched.size() != numTilesX * numTilesY)
+        tileTouched.assign(numTilesX * numTilesY, 1);
+
+    int half = particleSize / 2;
+    int alpha256 = (int)(clamp(alpha, 0.0f, 1.0f) * 256.0f);
+    std::vector<char> redrawn(numTilesX * numTilesY, 0);
+
+    // Each tile only writes inside its own rectangle, so tiles can be drawn in parallel
+#pragma omp parallel for schedule(dynamic)
+    for (int t = 0; t < numTilesX * numTilesY; ++t) {
+        int tileX0 = (t % numTilesX) * TILE_SIZE;
+        int tileY0 = (t / numTilesX) * TILE_SIZE;
+        int tileX1 = std::min(tileX0 + TILE_SIZE, fbWidth) - 1;
+        int tileY1 = std::min(tileY0 + TILE_SIZE, fbHeight) - 1;
+
+        // Only the tiles with particles in this or the previous frame change
+        bool hasParticles = tileStart[t] != tileStart[t + 1];
+        if (!hasParticles && !tileTouched[t]) continue;
+        tileTouched[t] = hasParticles;
+        redrawn[t] = 1;
+
+        // Clear the tile to black
+        for (int row = tileY0; row <= tileY1; ++row)
+            memset((void*)(framebuffer->pixels + row * fbWidth + tileX0), 0, (tileX1 - tileX0 + 1) * sizeof(Color));
+
+        for (int k = tileStart[t]; k < tileStart[t + 1]; ++k) {
+            int i = tileParticles[k];
+            int x = static_cast<int>(positionX[i]);
+            int y = static_cast<int>(positionY[i]);
+
+            // Clip the square to the tile once
+            int x0 = std::max(x - half, tileX0);
+            int x1 = std::min(x + half, tileX1);
+            int y0 = std::max(y - half, tileY0);
+            int y1 = std::min(y + half, tileY1);
+            if (x0 > x1 || y0 > y1) continue;
+
+            const Color c = colors[i];
+            int length = x1 - x0 + 1;
+
+            for (int row = y0; row <= y1; ++row) {
+                Color* span = framebuffer->pixels + row * fbWidth + x0;
+
+                if (blendMode == BLEND_NONE) {
+                    std::fill(span, span + length, c);
+                }
+                else if (blendMode == BLEND_ADDITIVE) {
+                    for (int j = 0; j < length; ++j) {
+                        span[j].r = (unsigned char)std::min(span[j].r + c.r, 255);
+                        span[j].g = (unsigned char)std::min(span[j].g + c.g, 255);
+                        span[j].b = (unsigned char)std::min(span[j].b + c.b, 255);
+                    }
+                }
+                else {
+                    for (int j = 0; j < length; ++j) {
+                        span[j].r = (unsigned char)(span[j].r + (((c.r - span[j].r) * alpha256) >> 8));
+                        span[j].g = (unsigned char)(span[j].g + (((c.g - span[j].g) * alpha256) >> 8));
+                        span[j].b = (unsigned char)(span[j].b + (((c.b - span[j].b) * alpha256) >> 8));
                     }
                 }
             }
         }
     }
-}
 
+    // Report the redrawn tiles as damage, one rectangle per row of tiles
+    for (int ty = 0; ty < numTilesY; ++ty) {
+        int first = -1, last = -1;
+        for (int tx = 0; tx < numTilesX; ++tx) {
+            if (!redrawn[ty * numTilesX + tx]) continue;
+            if (first < 0) first = tx;
+            last = tx;
+        }
+        if (first >= 0)
+            framebuffer->MarkDirty(first * TILE_SIZE, ty * TILE_SIZE, (last - first + 1) * TILE_SIZE, TILE_SIZE);
+    }
+}
\ No newline at end of file
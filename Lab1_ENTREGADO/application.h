@@ -7,24 +7,53 @@
 #include "main/includes.h"
 #include "framework.h"
 #include "image.h"
+#include "texture.h"
+#include "mesh.h"
 
 class ParticleSystem {
 public:
-    static const int MAX_PARTICLES = 1000; // Maximum number of particles
-
-    struct Particle {
-        Vector2 position;       // Current position
-        Vector2 velocity;       // Speed and direction
-        Color color;            // Particle color
-        float ttl;              // Time-to-live in seconds
-        bool inactive;          // Indicates if the particle is inactive
+    static const int DEFAULT_PARTICLES = 1000; // Default number of particles
+
+    // Small xorshift generator, each thread/chunk owns one so there is no shared state
+    struct FastRandom {
+        unsigned int state;
+        FastRandom(unsigned int seed) { state = seed ? seed : 0x9E3779B9u; }
+        unsigned int Next() { state ^= state << 13; state ^= state >> 17; state ^= state << 5; return state; }
+        float Range(float min, float max) { return min + (max - min) * (Next() >> 8) * (1.0f / 16777216.0f); }
     };
 
-    Particle particles[MAX_PARTICLES]; // Array of particles
+    // Particle attributes stored as separate arrays (SoA) so the update loops vectorize
+    std::vector<float> positionX, positionY;   // Current position
+    std::vector<float> velocityX, velocityY;   // Speed and direction (pixels per second)
+    std::vector<Color> colors;                 // Particle color
+    std::vector<float> ttl;                    // Time-to-live in seconds
+
+    int capacity = 0;         // Maximum number of particles
+    int numAlive = 0;         // Particles [0, numAlive) are alive
+    int width = 1280;         // Bounds used to wrap the particles around
+    int height = 720;
+    float lifetime = 120.0f;  // Seconds before a particle is respawned
+
+    // How the particles are composited over the framebuffer
+    enum eBlendMode { BLEND_NONE, BLEND_ADDITIVE, BLEND_ALPHA };
+    int blendMode = BLEND_NONE;
+    float alpha = 0.5f;       // Opacity used by BLEND_ALPHA
+    int particleSize = 5;     // Width and height of the square drawn for each particle
+
+    // Particles binned by screen tile: indices of tile t are tileParticles[tileStart[t] .. tileStart[t+1])
+    static const int TILE_SIZE = 64;
+    std::vector<int> tileStart;
+    std::vector<int> tileParticles;
+    std::vector<char> tileTouched; // Tiles that had particles in the last frame (must be cleared)
+    unsigned int seed = 1;    // Advanced every frame to seed the per-chunk generators
 
     // Methods
-    void Init();                       // Initialize all particles
+    void Init(int capacity = DEFAULT_PARTICLES, int width = 1280, int height = 720); // Allocate and spawn all particles
+    void SetBounds(int width, int height);
+    void Spawn(int count);             // Activate up to count new particles at the end of the alive range
+    void Kill(int index);              // Swap-remove a particle from the alive range
     void Render(Image* framebuffer);   // Draw particles on the framebuffer
+    void BinParticles(int numTilesX, int numTilesY); // Fill tileStart/tileParticles
     void Update(float dt);             // Update particles
 };
 
@@ -34,8 +63,9 @@ public:
     Vector2 position; // Top-left corner of the button
     Vector2 size;     // Size of the button
 
-    Button(const Image& icon, Vector2 position, Vector2 size)
-        : icon(icon), position(position), size(size) {
+    // The icon is taken by value, pass a temporary or std::move it to avoid copying its pixels
+    Button(Image icon, Vector2 position, Vector2 size)
+        : icon(std::move(icon)), position(position), size(size) {
     }
 
     // Render the button on the screen
@@ -64,6 +94,7 @@ public:
     ParticleSystem particleSystem; // Particle system instance
     bool particleSystemActive = false; // Flag to activate or deactivate the particle system
     bool buttonsstate = true;
+    bool toolbarDirty = true; // The toolbar must be redrawn even if nothing was drawn over it
     static const int numButtons = 16;
     Button* butt[numButtons];
 
@@ -101,6 +132,10 @@ public:
 
 	Image backupFramebuffer; // Backup framebuffer to restore the original state
 
+    // GPU copy of the framebuffer, only the dirty areas are uploaded each frame
+    Texture framebufferTexture;
+    Mesh quad;
+
 
     // Constructor and main methods
     Application(const char* caption, int width, int height);
@@ -110,6 +145,7 @@ public:
     void Render(void);
     void Update(float dt);
     void InitButtons(void);
+    void PresentFramebuffer(void);
 
     // Other methods to control the app
     void SetWindowSize(int width, int height) {
@@ -118,6 +154,7 @@ public:
         this->window_height = height;
         this->framebuffer.Resize(width, height);
         this->backupFramebuffer.Resize(width, height); // Update backup framebuffer as well
+        this->particleSystem.SetBounds(width, height);
 
     }
 
@@ -2,6 +2,9 @@
 #include <iostream>
 #include <fstream>
 #include <algorithm>
+#include <mutex>
+#include <stdint.h>
+#include <stdlib.h>
 #include "GL/glew.h"
 #include "../extra/picopng.h"
 #include "image.h"
@@ -9,6 +12,79 @@
 #include "camera.h"
 #include "mesh.h"
 
+static std::vector<void*> pool_buckets[64];
+static std::mutex pool_mutex;
+
+int ImageBufferPool::Bucket(size_t bytes)
+{
+    int bucket = 0;
+    while (((size_t)1 << bucket) < bytes)
+        bucket++;
+    return bucket;
+}
+
+void* ImageBufferPool::Acquire(size_t bytes)
+{
+    if (bytes == 0)
+        return NULL;
+
+    int bucket = Bucket(bytes);
+    {
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        if (!pool_buckets[bucket].empty()) {
+            void* buffer = pool_buckets[bucket].back();
+            pool_buckets[bucket].pop_back();
+            return buffer;
+        }
+    }
+
+    // Allocate the whole bucket size, with room to align the start and remember the original pointer
+    size_t capacity = (size_t)1 << bucket;
+    unsigned char* raw = (unsigned char*)malloc(capacity + ALIGNMENT + sizeof(void*));
+    if (!raw)
+        return NULL;
+    uintptr_t start = ((uintptr_t)(raw + sizeof(void*)) + ALIGNMENT - 1) & ~(uintptr_t)(ALIGNMENT - 1);
+    ((void**)start)[-1] = raw;
+    return (void*)start;
+}
+
+void ImageBufferPool::Release(void* buffer, size_t bytes)
+{
+    if (!buffer)
+        return;
+
+    int bucket = Bucket(bytes);
+    {
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        if ((int)pool_buckets[bucket].size() < MAX_CACHED) {
+            pool_buckets[bucket].push_back(buffer);
+            return;
+        }
+    }
+    free(((void**)buffer)[-1]);
+}
+
+void ImageBufferPool::Trim()
+{
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    for (std::vector<void*>& bucket : pool_buckets) {
+        for (void* buffer : bucket)
+            free(((void**)buffer)[-1]);
+        bucket.clear();
+    }
+}
+
+// Pixel buffers of Image always come from the pool, Color is 3 plain bytes so no constructor has to run
+static Color* AcquirePixels(unsigned int width, unsigned int height)
+{
+    return (Color*)ImageBufferPool::Acquire((size_t)width * height * sizeof(Color));
+}
+
+static void ReleasePixels(Color* pixels, unsigned int width, unsigned int height)
+{
+    ImageBufferPool::Release(pixels, (size_t)width * height * sizeof(Color));
+}
+
 Image::Image() {
     width = 0; height = 0;
     pixels = NULL;
@@ -18,8 +94,9 @@ Image::Image(unsigned int width, unsigned int height)
 {
     this->width = width;
     this->height = height;
-    pixels = new Color[width * height];
-    memset(pixels, 0, width * height * sizeof(Color));
+    pixels = AcquirePixels(width, height);
+    if (pixels)
+        memset(pixels, 0, width * height * sizeof(Color));
 }
 
 // Copy constructor
@@ -31,33 +108,73 @@ Image::Image(const Image& c)
     bytes_per_pixel = c.bytes_per_pixel;
     if (c.pixels)
     {
-        pixels = new Color[width * height];
+        pixels = AcquirePixels(width, height);
         memcpy(pixels, c.pixels, width * height * bytes_per_pixel);
     }
 }
 
+// Move constructor, takes the buffer of c
+Image::Image(Image&& c) noexcept
+{
+    width = c.width;
+    height = c.height;
+    bytes_per_pixel = c.bytes_per_pixel;
+    pixels = c.pixels;
+    trackDamage = c.trackDamage;
+    dirtyRects = std::move(c.dirtyRects);
+
+    c.pixels = NULL;
+    c.width = c.height = 0;
+}
+
 // Assign operator
 Image& Image::operator = (const Image& c)
 {
-    if (pixels) delete pixels;
-    pixels = NULL;
+    if (this == &c)
+        return *this;
+
+    // Keep the current buffer if it has the same size
+    if (!pixels || width != c.width || height != c.height || !c.pixels)
+    {
+        ReleasePixels(pixels, width, height);
+        pixels = c.pixels ? AcquirePixels(c.width, c.height) : NULL;
+    }
 
     width = c.width;
     height = c.height;
     bytes_per_pixel = c.bytes_per_pixel;
 
     if (c.pixels)
-    {
-        pixels = new Color[width * height * bytes_per_pixel];
         memcpy(pixels, c.pixels, width * height * bytes_per_pixel);
-    }
+
+    // The whole content has been replaced
+    MarkAllDirty();
+    return *this;
+}
+
+// Move assign operator
+Image& Image::operator = (Image&& c) noexcept
+{
+    if (this == &c)
+        return *this;
+
+    ReleasePixels(pixels, width, height);
+    width = c.width;
+    height = c.height;
+    bytes_per_pixel = c.bytes_per_pixel;
+    pixels = c.pixels;
+
+    c.pixels = NULL;
+    c.width = c.height = 0;
+
+    // The whole content has been replaced
+    MarkAllDirty();
     return *this;
 }
 
 Image::~Image()
 {
-    if (pixels)
-        delete pixels;
+    ReleasePixels(pixels, width, height);
 }
 
 void Image::Render()
@@ -69,44 +186,52 @@ void Image::Render()
 // Change image size (the old one will remain in the top-left corner)
 void Image::Resize(unsigned int width, unsigned int height)
 {
-    Color* new_pixels = new Color[width * height];
+    if (pixels && this->width == width && this->height == height)
+    {
+        MarkAllDirty();
+        return;
+    }
+
+    Color* new_pixels = AcquirePixels(width, height);
+    if (new_pixels)
+        memset((void*)new_pixels, 0, width * height * sizeof(Color));
     unsigned int min_width = this->width > width ? width : this->width;
     unsigned int min_height = this->height > height ? height : this->height;
 
-    for (unsigned int x = 0; x < min_width; ++x)
-        for (unsigned int y = 0; y < min_height; ++y)
-            new_pixels[y * width + x] = GetPixel(x, y);
+    for (unsigned int y = 0; y < min_height; ++y)
+        memcpy(new_pixels + y * width, pixels + y * this->width, min_width * sizeof(Color));
 
-    delete pixels;
+    ReleasePixels(pixels, this->width, this->height);
     this->width = width;
     this->height = height;
     pixels = new_pixels;
+    MarkAllDirty();
 }
 
 // Change image size and scale the content
-void Image::Scale(unsigned int width, unsigned int height)
+void Image::Scale(unsigned int width, unsigned int height, eResampleFilter filter)
 {
-    Color* new_pixels = new Color[width * height];
+    if (this->width == width && this->height == height)
+        return;
 
-    for (unsigned int x = 0; x < width; ++x)
-        for (unsigned int y = 0; y < height; ++y)
-            new_pixels[y * width + x] = GetPixel((unsigned int)(this->width * (x / (float)width)), (unsigned int)(this->height * (y / (float)height)));
+    Color* new_pixels = AcquirePixels(width, height);
+    if (pixels && new_pixels)
+        ImageFilter::Resample(GetView(), ImageView(new_pixels, width, height, width), filter);
+    else if (new_pixels)
+        memset((void*)new_pixels, 0, width * height * sizeof(Color));
 
-    delete pixels;
+    ReleasePixels(pixels, this->width, this->height);
     this->width = width;
     this->height = height;
     pixels = new_pixels;
+    MarkAllDirty();
 }
 
 Image Image::GetArea(unsigned int start_x, unsigned int start_y, unsigned int width, unsigned int height)
 {
+    // The part outside this image stays black
     Image result(width, height);
-    for (unsigned int x = 0; x < width; ++x)
-        for (unsigned int y = 0; y < height; ++y)
-        {
-            if ((x + start_x) < this->width && (y + start_y) < this->height)
-                result.SetPixelUnsafe(x, y, GetPixel(x + start_x, y + start_y));
-        }
+    result.GetView().CopyFrom(GetView(start_x, start_y, width, height));
     return result;
 }
 
@@ -179,9 +304,16 @@ bool Image::LoadPNG(const char* filename, bool flip_y)
 
     std::vector<unsigned char> out_image;
 
-    if (decodePNG(out_image, width, height, buffer.empty() ? 0 : &buffer[0], (unsigned long)buffer.size(), true) != 0)
+    // Decode to other variables, the current size is needed to release the current buffer
+    unsigned int png_width, png_height;
+    if (decodePNG(out_image, png_width, png_height, buffer.empty() ? 0 : &buffer[0], (unsigned long)buffer.size(), true) != 0)
         return false;
 
+    ReleasePixels(pixels, width, height);
+    pixels = NULL;
+    width = png_width;
+    height = png_height;
+
     size_t bufferSize = out_image.size();
     unsigned int originalBytesPerPixel = (unsigned int)bufferSize / (width * height);
 
@@ -189,13 +321,12 @@ bool Image::LoadPNG(const char* filename, bool flip_y)
     bytes_per_pixel = 3;
 
     if (originalBytesPerPixel == 3) {
-        pixels = new Color[bufferSize];
+        pixels = AcquirePixels(width, height);
         memcpy(pixels, &out_image[0], bufferSize);
     }
     else if (originalBytesPerPixel == 4) {
 
-        unsigned int newBufferSize = width * height * bytes_per_pixel;
-        pixels = new Color[newBufferSize];
+        pixels = AcquirePixels(width, height);
 
         unsigned int k = 0;
         for (unsigned int i = 0; i < bufferSize; i += originalBytesPerPixel) {
@@ -208,6 +339,7 @@ bool Image::LoadPNG(const char* filename, bool flip_y)
     if (flip_y)
         FlipY();
 
+    MarkAllDirty();
     return true;
 }
 
@@ -268,12 +400,11 @@ bool Image::LoadTGA(const char* filename, bool flip_y, bool flip_x)
     fclose(file);
 
     // Save info in image
-    if (pixels)
-        delete pixels;
+    ReleasePixels(pixels, width, height);
 
     width = tgainfo->width;
     height = tgainfo->height;
-    pixels = new Color[width * height];
+    pixels = AcquirePixels(width, height);
 
     // Convert to float all pixels
     for (unsigned int y = 0; y < height; ++y) {
@@ -291,12 +422,22 @@ bool Image::LoadTGA(const char* filename, bool flip_y, bool flip_x)
     delete tgainfo->data;
     delete tgainfo;
 
+    MarkAllDirty();
     return true;
 }
 
 // Saves the image to a TGA file
 bool Image::SaveTGA(const char* filename)
 {
+    return SaveTGA(filename, GetView());
+}
+
+// Writes any view, so a region can be saved without copying it to an image first
+bool Image::SaveTGA(const char* filename, const ConstImageView& view)
+{
+    unsigned int width = view.width;
+    unsigned int height = view.height;
+
     unsigned char TGAheader[12] = { 0, 0, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
 
     std::string fullPath = absResPath(filename);
@@ -322,7 +463,7 @@ bool Image::SaveTGA(const char* filename)
     for (unsigned int y = 0; y < height; ++y)
         for (unsigned int x = 0; x < width; ++x)
         {
-            Color c = pixels[y * width + x];
+            Color c = view.At(x, y);
             unsigned int pos = (y * width + x) * 3;
             bytes[pos + 2] = c.r;
             bytes[pos + 1] = c.g;
@@ -336,6 +477,25 @@ bool Image::SaveTGA(const char* filename)
 }
 
 void Image::DrawRect(int x, int y, int w, int h, const Color&
+    borderColor, int borderWidth, bool isFilled,
+    const Color& fillColor) {
+    MarkDirty(std::min(x, x + w), std::min(y, y + h), abs(w), abs(h));
+    ImageDraw::DrawRect(GetView(), x, y, w, h, borderColor, borderWidth, isFilled, fillColor);
+}
+
+void Image::FillSpan(int y, int x0, int x1, const Color& c) {
+    ImageDraw::FillSpan(GetView(), y, x0, x1, c);
+}
+
+void Image::FillRect(int x, int y, int w, int h, const Color& c) {
+    GetView(x, y, w, h).Fill(c);
+}
+
+void Image::FillSpans(const std::vector<std::pair<int, int>>& table, int minY, const Color& c) {
+    ImageDraw::FillSpans(GetView(), table, minY, c);
+}
+
+void ImageDraw::DrawRect(const ImageView& dst, int x, int y, int w, int h, const Color&
     borderColor, int borderWidth, bool isFilled,
     const Color& fillColor) {
     // Normalize coordinates to ensure positive width and height
@@ -350,57 +510,72 @@ void Image::DrawRect(int x, int y, int w, int h, const Color&
 
     // Fill the rectangle if required
     if (isFilled) {
-        for (int i = startX + borderWidth; i < startX + width - borderWidth; ++i) {
-            for (int j = startY + borderWidth; j < startY + height - borderWidth; ++j) {
-                SetPixel(i, j, fillColor);
-            }
-        }
+        FillRect(dst, startX + borderWidth, startY + borderWidth, width - 2 * borderWidth, height - 2 * borderWidth, fillColor);
     }
 
     // Draw the top and bottom borders
-    for (int i = 0; i < borderWidth; ++i) {
-        // Top border
-        for (int j = startX; j < startX + width; ++j) {
-            SetPixel(j, startY + i, borderColor);
-        }
-        // Bottom border
-        for (int j = startX; j < startX + width; ++j) {
-            SetPixel(j, startY + height - 1 - i, borderColor);
-        }
+    for (int i = 0; i < borderWidth && i < height; ++i) {
+        FillSpan(dst, startY + i, startX, startX + width - 1, borderColor);
+        FillSpan(dst, startY + height - 1 - i, startX, startX + width - 1, borderColor);
     }
 
     // Draw the left and right borders
-    for (int i = 0; i < borderWidth; ++i) {
-        // Left border
-        for (int j = startY; j < startY + height; ++j) {
-            SetPixel(startX + i, j, borderColor);
-        }
-        // Right border
-        for (int j = startY; j < startY + height; ++j) {
-            SetPixel(startX + width - 1 - i, j, borderColor);
-        }
+    for (int j = startY; j < startY + height; ++j) {
+        FillSpan(dst, j, startX, std::min(startX + borderWidth, startX + width) - 1, borderColor);
+        FillSpan(dst, j, std::max(startX + width - borderWidth, startX), startX + width - 1, borderColor);
     }
 }
 
+void ImageDraw::FillSpan(const ImageView& dst, int y, int x0, int x1, const Color& c) {
+    // Clip once for the whole span
+    if (y < 0 || y >= (int)dst.height) return;
+    x0 = std::max(x0, 0);
+    x1 = std::min(x1, (int)dst.width - 1);
+    if (x0 > x1) return;
 
+    Color* row = dst.Row(y) + x0;
+    int length = x1 - x0 + 1;
 
-#ifndef IGNORE_LAMBDAS
+    // Gray colors have the same value in every byte
+    if (c.r == c.g && c.g == c.b) {
+        memset((unsigned char*)row, c.r, length * sizeof(Color));
+        return;
+    }
 
+    // Otherwise write the first pixel and keep doubling the copied block
+    row[0] = c;
+    int filled = 1;
+    while (filled < length) {
+        int n = std::min(filled, length - filled);
+        memcpy(row + filled, row, n * sizeof(Color));
+        filled += n;
+    }
+}
 
-template <typename F>
-void ForEachPixel(Image& img, const Image& img2, F f) {
-    for (unsigned int pos = 0; pos < img.width * img.height; ++pos)
-        img.pixels[pos] = f(img.pixels[pos], img2.pixels[pos]);
+void ImageDraw::FillSpans(const ImageView& dst, const std::vector<std::pair<int, int>>& table, int minY, const Color& c) {
+    for (int i = 0; i < (int)table.size(); ++i) {
+        if (table[i].first <= table[i].second) // Valid row
+            FillSpan(dst, minY + i, table[i].first, table[i].second, c);
+    }
 }
 
-#endif
+static float* AcquireFloats(unsigned int width, unsigned int height)
+{
+    return (float*)ImageBufferPool::Acquire((size_t)width * height * sizeof(float));
+}
+
+static void ReleaseFloats(float* pixels, unsigned int width, unsigned int height)
+{
+    ImageBufferPool::Release(pixels, (size_t)width * height * sizeof(float));
+}
 
 FloatImage::FloatImage(unsigned int width, unsigned int height)
 {
     this->width = width;
     this->height = height;
-    pixels = new float[width * height];
-    memset(pixels, 0, width * height * sizeof(float));
+    pixels = AcquireFloats(width, height);
+    if (pixels)
+        memset(pixels, 0, width * height * sizeof(float));
 }
 
 // Copy constructor
@@ -411,80 +586,173 @@ FloatImage::FloatImage(const FloatImage& c) {
     height = c.height;
     if (c.pixels)
     {
-        pixels = new float[width * height];
+        pixels = AcquireFloats(width, height);
         memcpy(pixels, c.pixels, width * height * sizeof(float));
     }
 }
 
+// Move constructor, takes the buffer of c
+FloatImage::FloatImage(FloatImage&& c) noexcept
+{
+    width = c.width;
+    height = c.height;
+    pixels = c.pixels;
+
+    c.pixels = NULL;
+    c.width = c.height = 0;
+}
+
 // Assign operator
 FloatImage& FloatImage::operator = (const FloatImage& c)
 {
-    if (pixels) delete pixels;
-    pixels = NULL;
+    if (this == &c)
+        return *this;
+
+    // Keep the current buffer if it has the same size
+    if (!pixels || width != c.width || height != c.height || !c.pixels)
+    {
+        ReleaseFloats(pixels, width, height);
+        pixels = c.pixels ? AcquireFloats(c.width, c.height) : NULL;
+    }
 
     width = c.width;
     height = c.height;
     if (c.pixels)
-    {
-        pixels = new float[width * height * sizeof(float)];
         memcpy(pixels, c.pixels, width * height * sizeof(float));
-    }
+    return *this;
+}
+
+// Move assign operator
+FloatImage& FloatImage::operator = (FloatImage&& c) noexcept
+{
+    if (this == &c)
+        return *this;
+
+    ReleaseFloats(pixels, width, height);
+    width = c.width;
+    height = c.height;
+    pixels = c.pixels;
+
+    c.pixels = NULL;
+    c.width = c.height = 0;
     return *this;
 }
 
 FloatImage::~FloatImage()
 {
-    if (pixels)
-        delete pixels;
+    ReleaseFloats(pixels, width, height);
 }
 
 // Change image size (the old one will remain in the top-left corner)
 void FloatImage::Resize(unsigned int width, unsigned int height)
 {
-    float* new_pixels = new float[width * height];
+    if (pixels && this->width == width && this->height == height)
+        return;
+
+    float* new_pixels = AcquireFloats(width, height);
     unsigned int min_width = this->width > width ? width : this->width;
     unsigned int min_height = this->height > height ? height : this->height;
 
-    for (unsigned int x = 0; x < min_width; ++x)
-        for (unsigned int y = 0; y < min_height; ++y)
-            new_pixels[y * width + x] = GetPixel(x, y);
+    for (unsigned int y = 0; y < min_height; ++y)
+        memcpy(new_pixels + y * width, pixels + y * this->width, min_width * sizeof(float));
 
-    delete pixels;
+    ReleaseFloats(pixels, this->width, this->height);
     this->width = width;
     this->height = height;
     pixels = new_pixels;
 }
 
+// Kept for the labs, it now uses the integer rasterizer
 void Image::DrawLineDDA(int x0, int y0, int x1, int y1,
     const Color& color) {
-    // Calculate the differences in x and y
-    int dx = x1 - x0;
-    int dy = y1 - y0;
+    DrawLine(x0, y0, x1, y1, color);
+}
 
-    // Determine the number of steps required
-    int steps = std::max(abs(dx), abs(dy));
+// Region codes of a point outside the image
+enum { CLIP_INSIDE = 0, CLIP_LEFT = 1, CLIP_RIGHT = 2, CLIP_BOTTOM = 4, CLIP_TOP = 8 };
 
-    // Compute the increment for each step
-    float xIncrement = dx / static_cast<float>(steps);
-    float yIncrement = dy / static_cast<float>(steps);
+static int ComputeOutCode(int x, int y, int width, int height) {
+    int code = CLIP_INSIDE;
+    if (x < 0) code |= CLIP_LEFT;
+    else if (x >= width) code |= CLIP_RIGHT;
+    if (y < 0) code |= CLIP_BOTTOM;
+    else if (y >= height) code |= CLIP_TOP;
+    return code;
+}
 
-    // Starting point
-    float x = x0;
-    float y = y0;
+// floor(a / b) and ceil(a / b) for any signs
+static inline long long FloorDiv(long long a, long long b) { long long q = a / b; return (a % b != 0 && (a < 0) != (b < 0)) ? q - 1 : q; }
+static inline long long CeilDiv(long long a, long long b) { long long q = a / b; return (a % b != 0 && (a < 0) == (b < 0)) ? q + 1 : q; }
 
-    // Draw the line
-    for (int i = 0; i <= steps; ++i) {
-        // Set the pixel at the rounded position
-        if (x >= 0 && x < width && y >= 0 && y < height) {
-            SetPixel(static_cast<int>(round(x)),
-                static_cast<int>(round(y)), color);
-        }
+void Image::DrawLine(int x0, int y0, int x1, int y1, const Color& color) {
+    // Only the visible part is damaged
+    sRect visible;
+    if (ImageDraw::DrawLine(GetView(), x0, y0, x1, y1, color, &visible))
+        MarkDirty(visible.x, visible.y, visible.w, visible.h);
+}
+
+bool ImageDraw::DrawLine(const ImageView& dst, int x0, int y0, int x1, int y1, const Color& color, Image::sRect* visible) {
+    // Both ends on the same outer side: nothing to draw. Otherwise the visible part is the range of steps
+    // whose rounded pixel is inside, so the line is clipped without moving its endpoints
+    int width = dst.width, height = dst.height;
+    if (ComputeOutCode(x0, y0, width, height) & ComputeOutCode(x1, y1, width, height)) return false;
+
+    int dx = x1 - x0;
+    int dy = y1 - y0;
+    int steps = std::max(abs(dx), abs(dy));
+    if (steps == 0) {
+        if (visible) *visible = { x0, y0, 1, 1 };
+        dst.At(x0, y0) = color;
+        return true;
+    }
 
-        // Increment x and y
-        x += xIncrement;
-        y += yIncrement;
+    // One pixel per step on the major axis, the minor axis in 16.16 fixed point
+    bool xMajor = abs(dx) >= abs(dy);
+    int majorDir = (xMajor ? dx : dy) > 0 ? 1 : -1;
+    long long minorBase = (long long)(xMajor ? y0 : x0) * 65536 + 0x8000; // +0.5 to round
+    long long minorSlope = (long long)(xMajor ? dy : dx) * 65536 / steps;
+
+    auto pixelAt = [&](int n, int& x, int& y) {
+        int major = (xMajor ? x0 : y0) + n * majorDir;
+        int minor = (int)((minorBase + n * minorSlope) >> 16);
+        x = xMajor ? major : minor;
+        y = xMajor ? minor : major;
+    };
+
+    // Steps whose pixel is inside the image, solved on both axes in the fixed point of the walk
+    int majorSize = xMajor ? width : height;
+    int majorStart = xMajor ? x0 : y0;
+    long long first = 0, last = steps;
+    if (majorDir > 0) { first = std::max(first, (long long)-majorStart); last = std::min(last, (long long)majorSize - 1 - majorStart); }
+    else { first = std::max(first, (long long)majorStart - (majorSize - 1)); last = std::min(last, (long long)majorStart); }
+
+    long long minorMax = (long long)(xMajor ? height : width) * 65536 - 1;
+    if (minorSlope > 0) { first = std::max(first, CeilDiv(-minorBase, minorSlope)); last = std::min(last, FloorDiv(minorMax - minorBase, minorSlope)); }
+    else if (minorSlope < 0) { first = std::max(first, CeilDiv(minorMax - minorBase, minorSlope)); last = std::min(last, FloorDiv(-minorBase, minorSlope)); }
+    else if (minorBase < 0 || minorBase > minorMax) return false;
+    if (first > last) return false;
+    int nStart = (int)first, nEnd = (int)last;
+
+    int x, y, xEnd, yEnd;
+    pixelAt(nStart, x, y);
+    pixelAt(nEnd, xEnd, yEnd);
+    if (visible) *visible = { std::min(x, xEnd), std::min(y, yEnd), abs(xEnd - x) + 1, abs(yEnd - y) + 1 };
+
+    // Walk the visible steps without any bounds check
+    Color* pixel = &dst.At(x, y);
+    int majorStride = xMajor ? majorDir : majorDir * (int)dst.stride;
+    int minorStride = xMajor ? (int)dst.stride : 1;
+    long long minor = minorBase + nStart * minorSlope;
+
+    for (int n = nStart; n <= nEnd; ++n) {
+        *pixel = color;
+        long long next = minor + minorSlope;
+        pixel += majorStride + ((int)(next >> 16) - (int)(minor >> 16)) * minorStride;
+        minor = next;
     }
+    return true;
 }
+
 void Image::ScanLineDDA(int x0, int y0, int x1, int y1,
     std::vector<std::pair<int, int>>& table, int minY) {
     // Early return if y0 == y1 (horizontal line)
@@ -496,20 +764,44 @@ void Image::ScanLineDDA(int x0, int y0, int x1, int y1,
         std::swap(y0, y1);
     }
 
-    float slope = (float)(x1 - x0) / (y1 - y0); // Slope of the line
-    float x = x0;
+    // Only the rows of the table are walked
+    int firstY = std::max(y0, minY);
+    int lastY = std::min(y1, minY + (int)table.size() - 1);
+    if (firstY > lastY) return;
+
+    // x = x0 + floor(dx * (y - y0) / dy), stepped with an integer error term
+    long long dx = (long long)x1 - x0;
+    long long dy = (long long)y1 - y0;
+    long long q = dx / dy;
+    if (dx % dy != 0 && dx < 0) q--;
+    long long r = dx - q * dy; // 0 <= r < dy
 
-    for (int y = y0; y <= y1; ++y) {
+    long long offset = dx * (firstY - y0);
+    long long x = x0 + offset / dy;
+    long long err = offset % dy;
+    if (err < 0) { x--; err += dy; }
+
+    for (int y = firstY; y <= lastY; ++y) {
         int row = y - minY; // Offset row based on minY
-        if (row >= 0 && row < (int)table.size()) {
-            table[row].first = std::min(table[row].first, (int)x);  // Update minX
-            table[row].second = std::max(table[row].second, (int)x); // Update maxX
-        }
-        x += slope;
+        table[row].first = std::min(table[row].first, (int)x);  // Update minX
+        table[row].second = std::max(table[row].second, (int)x); // Update maxX
+
+        x += q;
+        err += r;
+        if (err >= dy) { x++; err -= dy; }
     }
 }
 
 void Image::DrawTriangle(const Vector2& p0, const Vector2& p1,
+    const Vector2& p2, const Color& borderColor,
+    bool isFilled, const Color& fillColor) {
+    int minX = (int)std::min({ p0.x, p1.x, p2.x }), maxX = (int)std::max({ p0.x, p1.x, p2.x });
+    int minY = (int)std::min({ p0.y, p1.y, p2.y }), maxY = (int)std::max({ p0.y, p1.y, p2.y });
+    MarkDirty(minX, minY, maxX - minX + 1, maxY - minY + 1);
+    ImageDraw::DrawTriangle(GetView(), p0, p1, p2, borderColor, isFilled, fillColor);
+}
+
+void ImageDraw::DrawTriangle(const ImageView& dst, const Vector2& p0, const Vector2& p1,
     const Vector2& p2, const Color& borderColor,
     bool isFilled, const Color& fillColor) {
     // Step 1: Sort vertices by Y-coordinate
@@ -524,25 +816,19 @@ void Image::DrawTriangle(const Vector2& p0, const Vector2& p1,
     std::vector<std::pair<int, int>> AET(maxY - minY + 1, { INT_MAX, INT_MIN });
 
     // Step 3: Use ScanLineDDA to populate AET
-    ScanLineDDA((int)v0.x, (int)v0.y, (int)v1.x, (int)v1.y, AET, minY);
-    ScanLineDDA((int)v1.x, (int)v1.y, (int)v2.x, (int)v2.y, AET, minY);
-    ScanLineDDA((int)v2.x, (int)v2.y, (int)v0.x, (int)v0.y, AET, minY);
+    Image::ScanLineDDA((int)v0.x, (int)v0.y, (int)v1.x, (int)v1.y, AET, minY);
+    Image::ScanLineDDA((int)v1.x, (int)v1.y, (int)v2.x, (int)v2.y, AET, minY);
+    Image::ScanLineDDA((int)v2.x, (int)v2.y, (int)v0.x, (int)v0.y, AET, minY);
 
     // Step 4: Fill the triangle
     if (isFilled) {
-        for (int i = 0; i < (int)AET.size(); ++i) {
-            if (AET[i].first <= AET[i].second) { // Valid row
-                for (int x = AET[i].first; x <= AET[i].second; ++x) {
-                    SetPixel(x, minY + i, fillColor);
-                }
-            }
-        }
+        FillSpans(dst, AET, minY, fillColor);
     }
 
     // Step 5: Draw the border
-    DrawLineDDA((int)v0.x, (int)v0.y, (int)v1.x, (int)v1.y, borderColor);
-    DrawLineDDA((int)v1.x, (int)v1.y, (int)v2.x, (int)v2.y, borderColor);
-    DrawLineDDA((int)v2.x, (int)v2.y, (int)v0.x, (int)v0.y, borderColor);
+    DrawLine(dst, (int)v0.x, (int)v0.y, (int)v1.x, (int)v1.y, borderColor);
+    DrawLine(dst, (int)v1.x, (int)v1.y, (int)v2.x, (int)v2.y, borderColor);
+    DrawLine(dst, (int)v2.x, (int)v2.y, (int)v0.x, (int)v0.y, borderColor);
 }
 
 
@@ -552,21 +838,48 @@ void Image::DrawTriangle(const Vector2& p0, const Vector2& p1,
 void Image::DrawCircle(int xc, int yc, int r, const Color&
     borderColor, int borderWidth, bool
     isFilled, const Color& fillColor) {
+    MarkDirty(xc - r, yc - r, 2 * r + 1, 2 * r + 1);
+    ImageDraw::DrawCircle(GetView(), xc, yc, r, borderColor, borderWidth, isFilled, fillColor);
+}
+
+void ImageDraw::DrawCircle(const ImageView& dst, int xc, int yc, int r, const Color&
+    borderColor, int borderWidth, bool
+    isFilled, const Color& fillColor) {
+    // Filled disk and thick borders are drawn one span per row
+    int inner = r - borderWidth; // Radius of the hole of the thick border
+    if (isFilled || borderWidth > 1) {
+        for (int dy = -r; dy <= r; ++dy) {
+            int outerX = (int)sqrtf((float)(r * r - dy * dy));
+            if (isFilled) {
+                FillSpan(dst, yc + dy, xc - outerX, xc + outerX, fillColor);
+            }
+            if (borderWidth > 1) {
+                int innerX = abs(dy) < inner ? (int)sqrtf((float)(inner * inner - dy * dy)) : -1;
+                FillSpan(dst, yc + dy, xc - outerX, xc - innerX - 1, borderColor);
+                FillSpan(dst, yc + dy, xc + innerX + 1, xc + outerX, borderColor);
+            }
+        }
+        if (borderWidth > 1) return;
+    }
+
     // Start at the topmost point
     int x = 0;
     int y = r;
     int p = 1 - r; // Initial decision parameter
 
-    // Helper function to draw symmetric points
+    // Helper function to draw symmetric points, the ones outside the view are skipped
+    auto setPixel = [&](int x, int y, const Color& c) {
+        if ((unsigned int)x < dst.width && (unsigned int)y < dst.height) dst.At(x, y) = c;
+        };
     auto drawSymmetricPoints = [&](int x, int y) {
-        SetPixel(xc + x, yc + y, borderColor);
-        SetPixel(xc - x, yc + y, borderColor);
-        SetPixel(xc + x, yc - y, borderColor);
-        SetPixel(xc - x, yc - y, borderColor);
-        SetPixel(xc + y, yc + x, borderColor);
-        SetPixel(xc - y, yc + x, borderColor);
-        SetPixel(xc + y, yc - x, borderColor);
-        SetPixel(xc - y, yc - x, borderColor);
+        setPixel(xc + x, yc + y, borderColor);
+        setPixel(xc - x, yc + y, borderColor);
+        setPixel(xc + x, yc - y, borderColor);
+        setPixel(xc - x, yc - y, borderColor);
+        setPixel(xc + y, yc + x, borderColor);
+        setPixel(xc - y, yc + x, borderColor);
+        setPixel(xc + y, yc - x, borderColor);
+        setPixel(xc - y, yc - x, borderColor);
         };
 
     // Draw the initial set of symmetric points
@@ -586,33 +899,548 @@ void Image::DrawCircle(int xc, int yc, int r, const Color&
         }
         drawSymmetricPoints(x, y);
     }
+}
+
+// Clips a w x h rectangle placed at (x,y) against a width x height view.
+// Returns false if nothing is visible, otherwise (x,y,w,h) is the visible part and (skipX,skipY) how much was cut from the top-left
+static bool ClipRect(int& x, int& y, int& w, int& h, int& skipX, int& skipY, int width, int height) {
+    skipX = std::max(0, -x);
+    skipY = std::max(0, -y);
+    x += skipX;
+    y += skipY;
+    w = std::min(w - skipX, width - x);
+    h = std::min(h - skipY, height - y);
+    return w > 0 && h > 0;
+}
+
+void Image::DrawImage(const ConstImageView& image, int x, int y) {
+    MarkDirty(x, y, image.width, image.height);
+    ImageDraw::DrawImage(GetView(), image, x, y);
+}
+
+void ImageDraw::DrawImage(const ImageView& dst, const ConstImageView& image, int x, int y) {
+    int w = image.width, h = image.height, srcX, srcY;
+    if (!ClipRect(x, y, w, h, srcX, srcY, dst.width, dst.height)) return;
+
+    // Each visible row is a single copy
+    for (int j = 0; j < h; ++j)
+        memcpy(dst.Row(y + j) + x, image.Row(srcY + j) + srcX, w * sizeof(Color));
+}
+
+void Image::DrawImageKeyed(const ConstImageView& image, int x, int y, const Color& key) {
+    MarkDirty(x, y, image.width, image.height);
+    ImageDraw::DrawImageKeyed(GetView(), image, x, y, key);
+}
+
+void ImageDraw::DrawImageKeyed(const ImageView& dst, const ConstImageView& image, int x, int y, const Color& key) {
+    int w = image.width, h = image.height, srcX, srcY;
+    if (!ClipRect(x, y, w, h, srcX, srcY, dst.width, dst.height)) return;
+
+    for (int j = 0; j < h; ++j) {
+        Color* out = dst.Row(y + j) + x;
+        const Color* src = image.Row(srcY + j) + srcX;
+        for (int i = 0; i < w; ++i) {
+            if (src[i].r != key.r || src[i].g != key.g || src[i].b != key.b)
+                out[i] = src[i];
+        }
+    }
+}
+
+void Image::DrawImageBlend(const ConstImageView& image, int x, int y, float alpha) {
+    MarkDirty(x, y, image.width, image.height);
+    ImageDraw::DrawImageBlend(GetView(), image, x, y, alpha);
+}
+
+void ImageDraw::DrawImageBlend(const ImageView& dst, const ConstImageView& image, int x, int y, float alpha) {
+    int w = image.width, h = image.height, srcX, srcY;
+    if (!ClipRect(x, y, w, h, srcX, srcY, dst.width, dst.height)) return;
+
+    // Fixed point opacity, the channels are blended as a flat byte array so the loop vectorizes
+    int a = (int)(clamp(alpha, 0.0f, 1.0f) * 256.0f);
+    int numBytes = w * 3;
+
+#pragma omp parallel for if(w * h > 65536)
+    for (int j = 0; j < h; ++j) {
+        unsigned char* out = (unsigned char*)(dst.Row(y + j) + x);
+        const unsigned char* src = (const unsigned char*)(image.Row(srcY + j) + srcX);
+#pragma omp simd
+        for (int i = 0; i < numBytes; ++i)
+            out[i] = (unsigned char)(out[i] + (((src[i] - out[i]) * a) >> 8));
+    }
+}
+
+void Image::DrawImageScaled(const ConstImageView& image, int x, int y, int w, int h) {
+    if (image.width == 0 || image.height == 0) return;
+    MarkDirty(x, y, w, h);
+    ImageDraw::DrawImageScaled(GetView(), image, x, y, w, h);
+}
+
+void ImageDraw::DrawImageScaled(const ImageView& dst, const ConstImageView& image, int x, int y, int w, int h) {
+    if (image.width == 0 || image.height == 0) return;
+
+    int fullW = w, fullH = h, skipX, skipY;
+    if (!ClipRect(x, y, w, h, skipX, skipY, dst.width, dst.height)) return;
+
+    // Source column of every destination column, computed once for all the rows
+    std::vector<unsigned int> columns(w);
+    for (int i = 0; i < w; ++i)
+        columns[i] = (unsigned int)(((long long)(i + skipX) * image.width) / fullW);
+
+    for (int j = 0; j < h; ++j) {
+        unsigned int row = (unsigned int)(((long long)(j + skipY) * image.height) / fullH);
+        Color* out = dst.Row(y + j) + x;
+        const Color* src = image.Row(row);
+        for (int i = 0; i < w; ++i)
+            out[i] = src[columns[i]];
+    }
+}
+
+void Image::MarkDirty(int x, int y, int w, int h) {
+    if (!trackDamage) return;
+
+    // Clip to the image
+    int x0 = std::max(x, 0);
+    int y0 = std::max(y, 0);
+    int x1 = std::min(x + w, (int)width);
+    int y1 = std::min(y + h, (int)height);
+    if (x0 >= x1 || y0 >= y1) return;
+
+    // Already covered by a previous rectangle
+    for (const sRect& d : dirtyRects) {
+        if (x0 >= d.x && y0 >= d.y && x1 <= d.x + d.w && y1 <= d.y + d.h)
+            return;
+    }
 
-    if (borderWidth != 1) {
-        for (int i = 1; i <= borderWidth; i++) {
-            DrawCircle(xc, yc, r - i, borderColor, 1, false, fillColor);
-            DrawCircle(xc + 1, yc, r - i, borderColor, 1, false, fillColor);
-            DrawCircle(xc, yc + 1, r - i, borderColor, 1, false, fillColor);
+    // Too many rectangles, keep only their bounding box
+    if (dirtyRects.size() >= MAX_DIRTY_RECTS) {
+        for (const sRect& d : dirtyRects) {
+            x0 = std::min(x0, d.x);
+            y0 = std::min(y0, d.y);
+            x1 = std::max(x1, d.x + d.w);
+            y1 = std::max(y1, d.y + d.h);
         }
+        dirtyRects.clear();
     }
 
+    sRect rect = { x0, y0, x1 - x0, y1 - y0 };
+    dirtyRects.push_back(rect);
+}
+
+bool Image::IsDirty(int x, int y, int w, int h) const {
+    for (const sRect& d : dirtyRects) {
+        if (x < d.x + d.w && d.x < x + w && y < d.y + d.h && d.y < y + h)
+            return true;
+    }
+    return false;
+}
 
-    if (isFilled == true) {
-        for (int i = 0; i < r; i++) {
-            DrawCircle(xc, yc, i, borderColor, 1);
-            DrawCircle(xc + 1, yc, i, borderColor, 1);
-            DrawCircle(xc, yc + 1, i, borderColor, 1);
+// Copies a row with r pixels repeated at each side, so the kernels can read past the borders without checks
+static void PadRow(const Color* row, int width, int r, unsigned char* out)
+{
+    const unsigned char* bytes = (const unsigned char*)row;
+    for (int i = 0; i < r; ++i) {
+        memcpy(out + i * 3, bytes, 3);
+        memcpy(out + (r + width + i) * 3, bytes + (width - 1) * 3, 3);
+    }
+    memcpy(out + r * 3, bytes, width * 3);
+}
+
+static inline unsigned char Saturate(float v)
+{
+    return (unsigned char)std::min(std::max(v + 0.5f, 0.0f), 255.0f);
+}
+
+template <int N>
+static void Convolve(const ConstImageView& src, const ImageView& dst, const float* kernel)
+{
+    const int r = N / 2;
+    int width = std::min(src.width, dst.width);
+    int height = std::min(src.height, dst.height);
+    if (width == 0 || height == 0) return;
+
+    int numBytes = width * 3;
+    int lineBytes = (width + 2 * r) * 3;
+
+#pragma omp parallel
+    {
+        // Per thread: the N padded source rows of the current output row and the accumulators
+        std::vector<unsigned char> lines(N * lineBytes);
+        std::vector<float> acc(numBytes);
+
+#pragma omp for schedule(static)
+        for (int y = 0; y < height; ++y) {
+            for (int k = 0; k < N; ++k)
+                PadRow(src.Row(std::min(std::max(y + k - r, 0), height - 1)), width, r, &lines[k * lineBytes]);
+
+            float* a = acc.data();
+            std::fill(acc.begin(), acc.end(), 0.0f);
+            for (int ky = 0; ky < N; ++ky) {
+                for (int kx = 0; kx < N; ++kx) {
+                    float weight = kernel[ky * N + kx];
+                    if (weight == 0.0f) continue;
+                    const unsigned char* line = &lines[ky * lineBytes + kx * 3];
+#pragma omp simd
+                    for (int i = 0; i < numBytes; ++i)
+                        a[i] += weight * line[i];
+                }
+            }
+
+            unsigned char* out = (unsigned char*)dst.Row(y);
+#pragma omp simd
+            for (int i = 0; i < numBytes; ++i)
+                out[i] = Saturate(a[i]);
         }
     }
 }
 
-void Image::DrawImage(const Image& image, int x, int y) {
-    for (unsigned int i = 0; i < image.width; ++i) {
-        for (unsigned int j = 0; j < image.height; ++j) {
-            int targetX = x + i;
-            int targetY = y + j;
-            if (targetX >= 0 && targetX < width && targetY >= 0 && targetY < height) {
-                SetPixel(targetX, targetY, image.GetPixel(i, j));
+void ImageFilter::Convolve3x3(const ConstImageView& src, const ImageView& dst, const float kernel[9])
+{
+    Convolve<3>(src, dst, kernel);
+}
+
+void ImageFilter::Convolve5x5(const ConstImageView& src, const ImageView& dst, const float kernel[25])
+{
+    Convolve<5>(src, dst, kernel);
+}
+
+void ImageFilter::Sharpen(const ConstImageView& src, const ImageView& dst, float amount)
+{
+    const float kernel[9] = {
+        0.0f,    -amount,               0.0f,
+        -amount, 1.0f + 4.0f * amount, -amount,
+        0.0f,    -amount,               0.0f
+    };
+    Convolve<3>(src, dst, kernel);
+}
+
+void ImageFilter::GaussianBlur(const ConstImageView& src, const ImageView& dst, float sigma)
+{
+    int width = std::min(src.width, dst.width);
+    int height = std::min(src.height, dst.height);
+    if (width == 0 || height == 0) return;
+    if (sigma <= 0.0f) {
+        dst.CopyFrom(src);
+        return;
+    }
+
+    // Normalized weights up to 3 sigma
+    int r = std::max(1, (int)ceilf(3.0f * sigma));
+    std::vector<float> weights(2 * r + 1);
+    float total = 0.0f;
+    for (int k = -r; k <= r; ++k)
+        total += weights[k + r] = expf(-(k * k) / (2.0f * sigma * sigma));
+    for (float& w : weights)
+        w /= total;
+
+    int numBytes = width * 3;
+    size_t tempBytes = (size_t)numBytes * height * sizeof(float);
+    float* temp = (float*)ImageBufferPool::Acquire(tempBytes);
+
+    // Horizontal pass, from the padded rows to the float buffer
+#pragma omp parallel
+    {
+        std::vector<unsigned char> line((width + 2 * r) * 3);
+
+#pragma omp for schedule(static)
+        for (int y = 0; y < height; ++y) {
+            PadRow(src.Row(y), width, r, line.data());
+            float* a = temp + (size_t)y * numBytes;
+            std::fill(a, a + numBytes, 0.0f);
+            for (int k = 0; k <= 2 * r; ++k) {
+                float weight = weights[k];
+                const unsigned char* l = &line[k * 3];
+#pragma omp simd
+                for (int i = 0; i < numBytes; ++i)
+                    a[i] += weight * l[i];
             }
         }
     }
-}
\ No newline at end of file
+
+    // Vertical pass, from the float buffer to dst
+#pragma omp parallel
+    {
+        std::vector<float> acc(numBytes);
+
+#pragma omp for schedule(static)
+        for (int y = 0; y < height; ++y) {
+            float* a = acc.data();
+            std::fill(acc.begin(), acc.end(), 0.0f);
+            for (int k = -r; k <= r; ++k) {
+                float weight = weights[k + r];
+                const float* row = temp + (size_t)std::min(std::max(y + k, 0), height - 1) * numBytes;
+#pragma omp simd
+                for (int i = 0; i < numBytes; ++i)
+                    a[i] += weight * row[i];
+            }
+
+            unsigned char* out = (unsigned char*)dst.Row(y);
+#pragma omp simd
+            for (int i = 0; i < numBytes; ++i)
+                out[i] = Saturate(a[i]);
+        }
+    }
+
+    ImageBufferPool::Release(temp, tempBytes);
+}
+
+void ImageFilter::BoxBlur(const ConstImageView& src, const ImageView& dst, int radius)
+{
+    int width = std::min(src.width, dst.width);
+    int height = std::min(src.height, dst.height);
+    if (width == 0 || height == 0) return;
+    if (radius <= 0) {
+        dst.CopyFrom(src);
+        return;
+    }
+
+    // Summed-area table with a zero first row and column: sat(x,y) is the sum of the pixels above and left
+    // of (x,y). 32 bits are enough for images up to 16 million pixels
+    int satStride = (width + 1) * 3;
+    size_t satBytes = (size_t)satStride * (height + 1) * sizeof(unsigned int);
+    unsigned int* sat = (unsigned int*)ImageBufferPool::Acquire(satBytes);
+    memset(sat, 0, satStride * sizeof(unsigned int));
+
+#pragma omp parallel for schedule(static)
+    for (int y = 0; y < height; ++y) {
+        unsigned int* row = sat + (size_t)(y + 1) * satStride;
+        const unsigned char* in = (const unsigned char*)src.Row(y);
+        row[0] = row[1] = row[2] = 0;
+        for (int i = 0; i < width * 3; ++i)
+            row[i + 3] = row[i] + in[i];
+    }
+
+    // Accumulate the rows down, each one is a vector add of the row above
+    for (int y = 1; y <= height; ++y) {
+        unsigned int* row = sat + (size_t)y * satStride;
+        const unsigned int* above = row - satStride;
+#pragma omp simd
+        for (int i = 0; i < satStride; ++i)
+            row[i] += above[i];
+    }
+
+    // Windows are clipped at the borders and divided by the pixels they really cover
+#pragma omp parallel for schedule(static)
+    for (int y = 0; y < height; ++y) {
+        int y0 = std::max(y - radius, 0), y1 = std::min(y + radius + 1, height);
+        const unsigned int* top = sat + (size_t)y0 * satStride;
+        const unsigned int* bottom = sat + (size_t)y1 * satStride;
+        unsigned char* out = (unsigned char*)dst.Row(y);
+
+        for (int x = 0; x < width; ++x) {
+            int x0 = std::max(x - radius, 0) * 3, x1 = std::min(x + radius + 1, width) * 3;
+            unsigned int count = (x1 - x0) / 3 * (y1 - y0);
+            for (int c = 0; c < 3; ++c) {
+                unsigned int sum = bottom[x1 + c] - bottom[x0 + c] - top[x1 + c] + top[x0 + c];
+                out[x * 3 + c] = (unsigned char)((sum + count / 2) / count);
+            }
+        }
+    }
+
+    ImageBufferPool::Release(sat, satBytes);
+}
+
+void ImageFilter::Sobel(const ConstImageView& src, const ImageView& dst)
+{
+    int width = std::min(src.width, dst.width);
+    int height = std::min(src.height, dst.height);
+    if (width == 0 || height == 0) return;
+
+    // Luminance with one pixel of border repeated on every side
+    int grayStride = width + 2;
+    size_t grayBytes = (size_t)grayStride * (height + 2);
+    unsigned char* gray = (unsigned char*)ImageBufferPool::Acquire(grayBytes);
+
+#pragma omp parallel for schedule(static)
+    for (int y = 0; y < height; ++y) {
+        const Color* in = src.Row(y);
+        unsigned char* row = gray + (size_t)(y + 1) * grayStride + 1;
+        for (int x = 0; x < width; ++x)
+            row[x] = (unsigned char)((77 * in[x].r + 150 * in[x].g + 29 * in[x].b) >> 8);
+        row[-1] = row[0];
+        row[width] = row[width - 1];
+    }
+    memcpy(gray, gray + grayStride, grayStride);
+    memcpy(gray + (size_t)(height + 1) * grayStride, gray + (size_t)height * grayStride, grayStride);
+
+#pragma omp parallel
+    {
+        std::vector<float> magnitude(width);
+
+#pragma omp for schedule(static)
+        for (int y = 0; y < height; ++y) {
+            const unsigned char* r0 = gray + (size_t)y * grayStride;
+            const unsigned char* r1 = r0 + grayStride;
+            const unsigned char* r2 = r1 + grayStride;
+            float* m = magnitude.data();
+#pragma omp simd
+            for (int x = 0; x < width; ++x) {
+                float gx = (float)(r0[x + 2] + 2 * r1[x + 2] + r2[x + 2]) - (float)(r0[x] + 2 * r1[x] + r2[x]);
+                float gy = (float)(r2[x] + 2 * r2[x + 1] + r2[x + 2]) - (float)(r0[x] + 2 * r0[x + 1] + r0[x + 2]);
+                m[x] = sqrtf(gx * gx + gy * gy);
+            }
+
+            Color* out = dst.Row(y);
+            for (int x = 0; x < width; ++x) {
+                unsigned char v = Saturate(m[x]);
+                out[x] = Color(v, v, v);
+            }
+        }
+    }
+
+    ImageBufferPool::Release(gray, grayBytes);
+}
+
+static float ResampleSupport(eResampleFilter filter)
+{
+    switch (filter) {
+        case RESAMPLE_BILINEAR: return 1.0f;
+        case RESAMPLE_BICUBIC:  return 2.0f;
+        case RESAMPLE_LANCZOS:  return 3.0f;
+        default:                return 0.5f;
+    }
+}
+
+static float ResampleKernel(eResampleFilter filter, float x)
+{
+    x = fabsf(x);
+    switch (filter) {
+        case RESAMPLE_BILINEAR:
+            return std::max(1.0f - x, 0.0f);
+        case RESAMPLE_BICUBIC:
+            if (x < 1.0f) return (1.5f * x - 2.5f) * x * x + 1.0f;
+            if (x < 2.0f) return ((-0.5f * x + 2.5f) * x - 4.0f) * x + 2.0f;
+            return 0.0f;
+        case RESAMPLE_LANCZOS: {
+            if (x < 1e-6f) return 1.0f;
+            if (x >= 3.0f) return 0.0f;
+            float px = (float)PI * x;
+            return 3.0f * sinf(px) * sinf(px / 3.0f) / (px * px);
+        }
+        default:
+            return x <= 0.5f ? 1.0f : 0.0f;
+    }
+}
+
+// Source pixels and weights of every output pixel along one axis, taps per output, indices already
+// clamped to the image and weights normalized
+struct sResampleTaps {
+    int taps;
+    std::vector<int> index;
+    std::vector<float> weight;
+};
+
+static void BuildResampleTaps(int srcSize, int dstSize, eResampleFilter filter, sResampleTaps& t)
+{
+    float scale = dstSize / (float)srcSize;
+    float filterScale = std::max(1.0f, 1.0f / scale);
+    float radius = ResampleSupport(filter) * filterScale;
+
+    t.taps = (int)ceilf(radius) * 2 + 1;
+    t.index.resize(dstSize * t.taps);
+    t.weight.resize(dstSize * t.taps);
+
+    for (int i = 0; i < dstSize; ++i) {
+        float center = (i + 0.5f) / scale - 0.5f;
+        int first = (int)floorf(center - radius) + 1;
+        int* index = &t.index[i * t.taps];
+        float* weight = &t.weight[i * t.taps];
+
+        float total = 0.0f;
+        for (int k = 0; k < t.taps; ++k) {
+            index[k] = std::min(std::max(first + k, 0), srcSize - 1);
+            weight[k] = ResampleKernel(filter, (first + k - center) / filterScale);
+            total += weight[k];
+        }
+
+        // Nearest never misses: the tap under the center gets all the weight if the others are zero
+        if (total <= 0.0f) {
+            index[0] = std::min(std::max((int)floorf(center + 0.5f), 0), srcSize - 1);
+            weight[0] = total = 1.0f;
+        }
+        for (int k = 0; k < t.taps; ++k)
+            weight[k] /= total;
+    }
+}
+
+void ImageFilter::Resample(const ConstImageView& src, const ImageView& dst, eResampleFilter filter)
+{
+    if (src.IsEmpty() || dst.IsEmpty()) return;
+
+    int srcW = src.width, srcH = src.height;
+    int dstW = dst.width, dstH = dst.height;
+
+    // Nearest is a copy per pixel, row by row with the source column of every output column precomputed
+    if (filter == RESAMPLE_NEAREST) {
+        std::vector<int> columns(dstW);
+        for (int x = 0; x < dstW; ++x)
+            columns[x] = (int)(((long long)x * srcW) / dstW);
+
+#pragma omp parallel for schedule(static)
+        for (int y = 0; y < dstH; ++y) {
+            const Color* in = src.Row((int)(((long long)y * srcH) / dstH));
+            Color* out = dst.Row(y);
+            for (int x = 0; x < dstW; ++x)
+                out[x] = in[columns[x]];
+        }
+        return;
+    }
+
+    sResampleTaps horizontal, vertical;
+    BuildResampleTaps(srcW, dstW, filter, horizontal);
+    BuildResampleTaps(srcH, dstH, filter, vertical);
+
+    // Horizontal pass: every source row to dstW pixels, as floats
+    int rowFloats = dstW * 3;
+    size_t tempBytes = (size_t)rowFloats * srcH * sizeof(float);
+    float* temp = (float*)ImageBufferPool::Acquire(tempBytes);
+    int hTaps = horizontal.taps;
+
+#pragma omp parallel for schedule(static)
+    for (int y = 0; y < srcH; ++y) {
+        const unsigned char* in = (const unsigned char*)src.Row(y);
+        float* out = temp + (size_t)y * rowFloats;
+        for (int x = 0; x < dstW; ++x) {
+            const int* index = &horizontal.index[x * hTaps];
+            const float* weight = &horizontal.weight[x * hTaps];
+            float r = 0.0f, g = 0.0f, b = 0.0f;
+            for (int k = 0; k < hTaps; ++k) {
+                const unsigned char* p = in + index[k] * 3;
+                r += weight[k] * p[0];
+                g += weight[k] * p[1];
+                b += weight[k] * p[2];
+            }
+            out[x * 3] = r;
+            out[x * 3 + 1] = g;
+            out[x * 3 + 2] = b;
+        }
+    }
+
+    // Vertical pass: every output row is a weighted sum of whole rows of the buffer
+    int vTaps = vertical.taps;
+
+#pragma omp parallel
+    {
+        std::vector<float> acc(rowFloats);
+
+#pragma omp for schedule(static)
+        for (int y = 0; y < dstH; ++y) {
+            float* a = acc.data();
+            std::fill(acc.begin(), acc.end(), 0.0f);
+            for (int k = 0; k < vTaps; ++k) {
+                float weight = vertical.weight[y * vTaps + k];
+                if (weight == 0.0f) continue;
+                const float* row = temp + (size_t)vertical.index[y * vTaps + k] * rowFloats;
+#pragma omp simd
+                for (int i = 0; i < rowFloats; ++i)
+                    a[i] += weight * row[i];
+            }
+
+            unsigned char* out = (unsigned char*)dst.Row(y);
+#pragma omp simd
+            for (int i = 0; i < rowFloats; ++i)
+                out[i] = Saturate(a[i]);
+        }
+    }
+
+    ImageBufferPool::Release(temp, tempBytes);
+}
@@ -8,6 +8,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <iostream>
+#include <algorithm>
 #include "framework.h"
 
 //remove unsafe warnings
@@ -20,6 +21,81 @@ class FloatImage;
 class Entity;
 class Camera;
 
+// Recycles the pixel buffers of Image and FloatImage. Buffers are 64-byte aligned and kept in buckets
+// by size (powers of two), so a released buffer serves any later request that falls in the same bucket
+// (window resizes, temporaries created every frame, ...)
+class ImageBufferPool
+{
+public:
+    static const size_t ALIGNMENT = 64;
+    static const int MAX_CACHED = 4; // Free buffers kept per bucket, the rest are returned to the system
+
+    static void* Acquire(size_t bytes); // NULL for 0 bytes
+    static void Release(void* buffer, size_t bytes); // bytes must be the ones passed to Acquire
+    static void Trim(); // Frees all the cached buffers
+
+private:
+    static int Bucket(size_t bytes);
+};
+
+// Non-owning view of a rectangle of pixels: the first pixel, the size and the stride (pixels from one
+// row to the next). Views never allocate or free, they stay valid while the image they come from is
+// not resized. Sub-rectangles are views too, so tiles and crops need no copy
+template <typename T>
+struct tImageView
+{
+    T* pixels = NULL;
+    unsigned int width = 0;
+    unsigned int height = 0;
+    unsigned int stride = 0;
+
+    tImageView() {}
+    tImageView(T* pixels, unsigned int width, unsigned int height, unsigned int stride)
+        : pixels(pixels), width(width), height(height), stride(stride) {}
+
+    // A writable view can be passed where a read only one is expected
+    template <typename U>
+    tImageView(const tImageView<U>& v) : pixels(v.pixels), width(v.width), height(v.height), stride(v.stride) {}
+
+    bool IsEmpty() const { return width == 0 || height == 0; }
+    T* Row(unsigned int y) const { return pixels + (size_t)y * stride; }
+    T& At(unsigned int x, unsigned int y) const { return pixels[(size_t)y * stride + x]; }
+
+    // The rectangle (x,y,w,h) of this view, clipped to it
+    tImageView SubView(int x, int y, int w, int h) const {
+        int x0 = std::max(x, 0), y0 = std::max(y, 0);
+        int x1 = std::min(x + w, (int)width), y1 = std::min(y + h, (int)height);
+        if (x1 <= x0 || y1 <= y0) return tImageView(pixels, 0, 0, stride);
+        return tImageView(Row(y0) + x0, x1 - x0, y1 - y0, stride);
+    }
+
+    void Fill(const T& v) const {
+        for (unsigned int y = 0; y < height; ++y)
+            std::fill(Row(y), Row(y) + width, v);
+    }
+
+    // Copies the top-left part of src that fits in this view, one memcpy per row
+    void CopyFrom(const tImageView<const T>& src) const {
+        unsigned int w = std::min(width, src.width), h = std::min(height, src.height);
+        for (unsigned int y = 0; y < h; ++y)
+            memcpy(Row(y), src.Row(y), w * sizeof(T));
+    }
+};
+
+// Reconstruction filters of Image::Scale and ImageFilter::Resample
+enum eResampleFilter {
+    RESAMPLE_NEAREST,
+    RESAMPLE_BILINEAR,
+    RESAMPLE_BICUBIC,   // Catmull-Rom
+    RESAMPLE_LANCZOS    // Lanczos with 3 lobes
+};
+
+class Image;
+typedef tImageView<Color> ImageView;
+typedef tImageView<const Color> ConstImageView;
+typedef tImageView<float> FloatImageView;
+typedef tImageView<const float> ConstFloatImageView;
+
 // A matrix of pixels
 class Image
 {
@@ -36,12 +112,34 @@ public:
     unsigned int width;
     unsigned int height;
     unsigned int bytes_per_pixel = 3; // Bits per pixel
+
+    // Drawing into the whole image, see ImageDraw for the same routines on any view
     void DrawLineDDA(int x0, int y0, int x1, int y1, const Color& color);
+    void DrawLine(int x0, int y0, int x1, int y1, const Color& color); // Integer Bresenham on the clipped line
     void DrawRect(int x, int y, int w, int h, const Color& borderColor, int borderWidth, bool isFilled = false, const Color& fillColor = Color::BLACK);
     void DrawTriangle(const Vector2& p0, const Vector2& p1, const Vector2& p2, const Color& borderColor, bool isFilled, const Color& fillColor);
     void DrawCircle(int x, int y, int r, const Color& borderColor, int borderWidth, bool isFilled = false, const Color& fillColor = Color::BLACK);
-    void ScanLineDDA(int x0, int y0, int x1, int y1, std::vector<std::pair<int, int>>& table, int minY);
-    void DrawImage(const Image& image, int x, int y);
+    static void ScanLineDDA(int x0, int y0, int x1, int y1, std::vector<std::pair<int, int>>& table, int minY);
+    void DrawImage(const ConstImageView& image, int x, int y);
+
+    // Span filling, the base of all the filled shapes (they do not record damage, the callers do)
+    void FillSpan(int y, int x0, int x1, const Color& c); // Fills pixels x0..x1 (inclusive) of row y, clipped
+    void FillRect(int x, int y, int w, int h, const Color& c);
+    void FillSpans(const std::vector<std::pair<int, int>>& table, int minY, const Color& c); // One span per row, as built by ScanLineDDA
+    void DrawImageKeyed(const ConstImageView& image, int x, int y, const Color& key); // Pixels equal to key are transparent
+    void DrawImageBlend(const ConstImageView& image, int x, int y, float alpha);      // Constant opacity in [0,1]
+    void DrawImageScaled(const ConstImageView& image, int x, int y, int w, int h);    // Nearest neighbour to a w x h rectangle
+
+    // Damage tracking: when enabled, drawing operations record the rectangles they modify
+    struct sRect { int x, y, w, h; };
+    static const int MAX_DIRTY_RECTS = 32; // Above this the rectangles are merged into their bounding box
+    bool trackDamage = false;
+    std::vector<sRect> dirtyRects;
+
+    void MarkDirty(int x, int y, int w, int h);
+    void MarkAllDirty() { MarkDirty(0, 0, width, height); }
+    void ClearDirty() { dirtyRects.clear(); }
+    bool IsDirty(int x, int y, int w, int h) const; // Checks if the area intersects any dirty rectangle
 
 
     Color* pixels;
@@ -50,7 +148,9 @@ public:
     Image();
     Image(unsigned int width, unsigned int height);
     Image(const Image& c);
+    Image(Image&& c) noexcept;
     Image& operator = (const Image& c); // Assign operator
+    Image& operator = (Image&& c) noexcept; // Takes the buffer of c, leaving it empty
 
     // Destructor
     ~Image();
@@ -71,20 +171,31 @@ public:
     inline void SetPixelUnsafe(unsigned int x, unsigned int y, const Color& c) { pixels[y * width + x] = c; }
 
     void Resize(unsigned int width, unsigned int height);
-    void Scale(unsigned int width, unsigned int height);
+    void Scale(unsigned int width, unsigned int height, eResampleFilter filter = RESAMPLE_BILINEAR);
 
     void FlipY(); // Flip 
 	void FlipX(); 
     // Fill the image with the color C
-    void Fill(const Color& c) { for (unsigned int pos = 0; pos < width * height; ++pos) pixels[pos] = c; }
+    void Fill(const Color& c) { for (unsigned int pos = 0; pos < width * height; ++pos) pixels[pos] = c; MarkAllDirty(); }
+
+    // Views of the whole image or of a rectangle of it (clipped), no pixels are copied.
+    // An Image can be passed directly to any function that takes a view
+    ImageView GetView() { return ImageView(pixels, width, height, width); }
+    ConstImageView GetView() const { return ConstImageView(pixels, width, height, width); }
+    ImageView GetView(int x, int y, int w, int h) { return GetView().SubView(x, y, w, h); }
+    ConstImageView GetView(int x, int y, int w, int h) const { return GetView().SubView(x, y, w, h); }
+    operator ImageView() { return GetView(); }
+    operator ConstImageView() const { return GetView(); }
 
     // Returns a new image with the area from (startx,starty) of size width,height
+    // (use GetView to work on the area in place)
     Image GetArea(unsigned int start_x, unsigned int start_y, unsigned int width, unsigned int height);
 
     // Save or load images from the hard drive
     bool LoadPNG(const char* filename, bool flip_y = true);
     bool LoadTGA(const char* filename, bool flip_y = false, bool flip_x = true);
     bool SaveTGA(const char* filename);
+    static bool SaveTGA(const char* filename, const ConstImageView& view);
 
     // Used to easy code
 #ifndef IGNORE_LAMBDAS
@@ -92,10 +203,13 @@ public:
 // Applies an algorithm to every pixel in an image
 // you can use lambda sintax:   img.forEachPixel( [](Color c) { return c*2; });
 // or callback sintax:   img.forEachPixel( mycallback ); //the callback has to be Color mycallback(Color c) { ... }
+// Big images are split among threads, so the callback must not depend on the order of the pixels
     template <typename F>
     Image& ForEachPixel(F callback)
     {
-        for (unsigned int pos = 0; pos < width * height; ++pos)
+        int size = width * height;
+#pragma omp parallel for if(size > 65536)
+        for (int pos = 0; pos < size; ++pos)
             pixels[pos] = callback(pixels[pos]);
         return *this;
     }
@@ -115,7 +229,9 @@ public:
     FloatImage() { width = height = 0; pixels = NULL; }
     FloatImage(unsigned int width, unsigned int height);
     FloatImage(const FloatImage& c);
+    FloatImage(FloatImage&& c) noexcept;
     FloatImage& operator = (const FloatImage& c); //assign operator
+    FloatImage& operator = (FloatImage&& c) noexcept;
 
     //destructor
     ~FloatImage();
@@ -131,4 +247,188 @@ public:
     inline void SetPixelUnsafe(unsigned int x, unsigned int y, const float& v) { pixels[y * width + x] = v; }
 
     void Resize(unsigned int width, unsigned int height);
-};
\ No newline at end of file
+
+    FloatImageView GetView() { return FloatImageView(pixels, width, height, width); }
+    ConstFloatImageView GetView() const { return ConstFloatImageView(pixels, width, height, width); }
+    FloatImageView GetView(int x, int y, int w, int h) { return GetView().SubView(x, y, w, h); }
+    ConstFloatImageView GetView(int x, int y, int w, int h) const { return GetView().SubView(x, y, w, h); }
+    operator FloatImageView() { return GetView(); }
+    operator ConstFloatImageView() const { return GetView(); }
+};
+
+// Drawing into a view: the same lines, shapes, spans and blits as Image, clipped to the view, so they can
+// draw into a tile or a sub-rectangle of an image. Views have no damage tracking, the Image versions
+// record it and forward here
+class ImageDraw
+{
+public:
+    // Returns the visible part of the line in visible (if not NULL), or false if nothing was drawn
+    static bool DrawLine(const ImageView& dst, int x0, int y0, int x1, int y1, const Color& color, Image::sRect* visible = NULL);
+    static void DrawRect(const ImageView& dst, int x, int y, int w, int h, const Color& borderColor, int borderWidth, bool isFilled = false, const Color& fillColor = Color::BLACK);
+    static void DrawTriangle(const ImageView& dst, const Vector2& p0, const Vector2& p1, const Vector2& p2, const Color& borderColor, bool isFilled, const Color& fillColor);
+    static void DrawCircle(const ImageView& dst, int x, int y, int r, const Color& borderColor, int borderWidth, bool isFilled = false, const Color& fillColor = Color::BLACK);
+
+    static void FillSpan(const ImageView& dst, int y, int x0, int x1, const Color& c);
+    static void FillRect(const ImageView& dst, int x, int y, int w, int h, const Color& c) { dst.SubView(x, y, w, h).Fill(c); }
+    static void FillSpans(const ImageView& dst, const std::vector<std::pair<int, int>>& table, int minY, const Color& c);
+
+    static void DrawImage(const ImageView& dst, const ConstImageView& image, int x, int y);
+    static void DrawImageKeyed(const ImageView& dst, const ConstImageView& image, int x, int y, const Color& key);
+    static void DrawImageBlend(const ImageView& dst, const ConstImageView& image, int x, int y, float alpha);
+    static void DrawImageScaled(const ImageView& dst, const ConstImageView& image, int x, int y, int w, int h);
+};
+
+// Image filters. Each one reads src and writes dst, which must not overlap (filter into a second image,
+// its buffer comes from the pool). The area both views cover is filtered and the pixels outside the
+// borders repeat the edge. Rows are split among threads and the inner loops run over the channel bytes
+// of a row so they vectorize, results are saturated to [0,255]
+class ImageFilter
+{
+public:
+    // Generic kernels, row major (kernel[ky * N + kx])
+    static void Convolve3x3(const ConstImageView& src, const ImageView& dst, const float kernel[9]);
+    static void Convolve5x5(const ConstImageView& src, const ImageView& dst, const float kernel[25]);
+
+    // Separable: a horizontal and a vertical pass through a pooled float buffer
+    static void GaussianBlur(const ConstImageView& src, const ImageView& dst, float sigma);
+
+    // Mean of the (2 * radius + 1)^2 window from a summed-area table, the cost does not depend on the radius
+    static void BoxBlur(const ConstImageView& src, const ImageView& dst, int radius);
+
+    // Gradient magnitude of the luminance, as gray
+    static void Sobel(const ConstImageView& src, const ImageView& dst);
+
+    // src + amount * (src - mean of the 4 neighbours)
+    static void Sharpen(const ConstImageView& src, const ImageView& dst, float amount = 1.0f);
+
+    // Scales src to the size of dst. Separable: the rows are filtered into a pooled float buffer and then
+    // the columns, with the taps and weights of every output column and row computed once. When
+    // shrinking the filter is widened so every source pixel contributes
+    static void Resample(const ConstImageView& src, const ImageView& dst, eResampleFilter filter);
+};
+
+#ifndef IGNORE_LAMBDAS
+
+// Pixel pipeline: per pixel functions over views, in one pass. Rows are split among threads when there
+// are more than PIXEL_PARALLEL_MIN pixels, so callbacks must not depend on the order of the pixels.
+// All the source views must be at least as big as the destination
+static const int PIXEL_PARALLEL_MIN = 65536;
+
+// dst(x,y) = f(src(x,y)), src and dst can be the same view
+template <typename F>
+void MapPixels(const ConstImageView& src, const ImageView& dst, F f)
+{
+    int width = dst.width, height = dst.height;
+#pragma omp parallel for if(width * height > PIXEL_PARALLEL_MIN)
+    for (int y = 0; y < height; ++y) {
+        const Color* in = src.Row(y);
+        Color* out = dst.Row(y);
+        for (int x = 0; x < width; ++x)
+            out[x] = f(in[x]);
+    }
+}
+
+inline const Color* PixelRow(const ConstImageView& view, int y) { return view.Row(y); }
+
+// dst(x,y) = f(dst(x,y), a(x,y), b(x,y), ...) for any number of sources (images or views)
+// ZipPixels(framebuffer, [](Color d, Color a, Color b) { return a * 0.5f + b * 0.5f; }, imageA, imageB);
+template <typename F, typename... Sources>
+void ZipPixels(const ImageView& dst, F f, const Sources&... sources)
+{
+    int width = dst.width, height = dst.height;
+#pragma omp parallel for if(width * height > PIXEL_PARALLEL_MIN)
+    for (int y = 0; y < height; ++y) {
+        Color* out = dst.Row(y);
+        for (int x = 0; x < width; ++x)
+            out[x] = f(out[x], PixelRow(sources, y)[x]...);
+    }
+}
+
+// You can apply and algorithm for two images and store the result in the first one
+// ForEachPixel( img, img2, [](Color a, Color b) { return a + b; } );
+template <typename F>
+void ForEachPixel(Image& img, const Image& img2, F f) {
+    ZipPixels(img.GetView(), f, img2);
+}
+
+// Calls f(bytes, numBytes, y) with the channel bytes of every row, for loops written to vectorize
+// (e.g. with #pragma omp simd over the bytes)
+template <typename F>
+void ForEachRowBytes(const ImageView& img, F f)
+{
+    int height = img.height;
+    int numBytes = img.width * 3;
+#pragma omp parallel for if(img.width * img.height > PIXEL_PARALLEL_MIN)
+    for (int y = 0; y < height; ++y)
+        f((unsigned char*)img.Row(y), numBytes, y);
+}
+
+// Folds all the pixels into a value. Each thread folds its rows into a copy of init with f(T&, Color) and
+// the partial values are merged with combine(T&, const T&), so init must not change the result when merged
+template <typename T, typename F, typename C>
+T ReducePixels(const ConstImageView& src, const T& init, F f, C combine)
+{
+    T result = init;
+    int width = src.width, height = src.height;
+#pragma omp parallel if(width * height > PIXEL_PARALLEL_MIN)
+    {
+        T partial = init;
+#pragma omp for schedule(static) nowait
+        for (int y = 0; y < height; ++y) {
+            const Color* row = src.Row(y);
+            for (int x = 0; x < width; ++x)
+                f(partial, row[x]);
+        }
+#pragma omp critical
+        combine(result, partial);
+    }
+    return result;
+}
+
+struct sHistogram {
+    unsigned int r[256], g[256], b[256];
+};
+
+inline sHistogram ComputeHistogram(const ConstImageView& src)
+{
+    sHistogram empty = {};
+    return ReducePixels(src, empty,
+        [](sHistogram& h, const Color& c) { h.r[c.r]++; h.g[c.g]++; h.b[c.b]++; },
+        [](sHistogram& h, const sHistogram& p) {
+            for (int i = 0; i < 256; ++i) { h.r[i] += p.r[i]; h.g[i] += p.g[i]; h.b[i] += p.b[i]; }
+        });
+}
+
+// Chain of per pixel functions fused in a single pass over the image:
+// PixelPipeline().Map(exposure).Map(contrast).Map(tint).Run(framebuffer);
+struct sPixelIdentity {
+    Color operator()(const Color& c) const { return c; }
+};
+
+template <typename F, typename G>
+struct tPixelChain {
+    F first;
+    G second;
+    Color operator()(const Color& c) const { return second(first(c)); }
+};
+
+template <typename F>
+class tPixelPipeline
+{
+public:
+    F f;
+
+    explicit tPixelPipeline(F f) : f(f) {}
+
+    template <typename G>
+    tPixelPipeline<tPixelChain<F, G>> Map(G g) const { return tPixelPipeline<tPixelChain<F, G>>(tPixelChain<F, G>{ f, g }); }
+
+    Color operator()(const Color& c) const { return f(c); }
+
+    void Run(const ImageView& img) const { MapPixels(img, img, f); }
+    void Run(const ConstImageView& src, const ImageView& dst) const { MapPixels(src, dst, f); }
+};
+
+inline tPixelPipeline<sPixelIdentity> PixelPipeline() { return tPixelPipeline<sPixelIdentity>(sPixelIdentity()); }
+
+#endif
@@ -9,6 +9,7 @@ std::map<std::string, Texture*> Texture::s_Textures;
 
 Texture::Texture()
 {
+	texture_id = 0;
 	width = 0;
 	height = 0;
 	format = GL_RGB;
@@ -74,6 +75,24 @@ void Texture::Upload(unsigned int format, unsigned int type, bool mipmaps, Uint8
 	glBindTexture(GL_TEXTURE_2D, 0);
 }
 
+//uploads only a rectangle of the image to the VRAM
+void Texture::UploadArea(int x, int y, int w, int h, int row_length, Uint8* data)
+{
+	glBindTexture(GL_TEXTURE_2D, texture_id);
+
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, row_length);
+	glPixelStorei(GL_UNPACK_SKIP_PIXELS, x);
+	glPixelStorei(GL_UNPACK_SKIP_ROWS, y);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, w, h, format, type, data);
+
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
+	glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
+
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
+
 bool Texture::Load(const char* filename, bool mipmaps)
 {
 	std::string sfullPath = absResPath(filename);
@@ -41,6 +41,7 @@ public:
 	static void UnbindAll();
 
 	void Upload(unsigned int format, unsigned int type, bool mipmaps, Uint8* data, unsigned int internal_format = 0);
+	void UploadArea(int x, int y, int w, int h, int row_length, Uint8* data); // data points to the whole image, row_length pixels per row
 	bool Load(const char* filename, bool mipmaps = true);
 	void GenerateMipmaps();
 